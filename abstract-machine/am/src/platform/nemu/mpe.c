@@ -1,12 +1,68 @@
 #include <am.h>
+#include <nemu.h>
 #include <stdatomic.h>
 #include <klib-macros.h>
 
-bool mpe_init(void (*entry)()) {
-  entry();
+#define MAX_CPU 32
+#define STACK_SIZE 0x8000
+
+static void (* volatile user_entry)() = NULL;
+
+void __am_mpe_entry() {
+  user_entry();
   panic("MPE entry returns");
 }
 
+#if defined(__riscv)
+// NEMU gives the number of harts in a custom read-only CSR
+#define CSR_MNHART 0xfc0
+
+/* All harts start at _start, where those other than hart 0 wait until
+ * mpe_init() sets their stack pointers in __am_mpe_sp[]. The stacks are
+ * taken from the top of the heap before main() runs. */
+volatile uintptr_t __am_mpe_sp[MAX_CPU] = {};
+static uintptr_t stack_top[MAX_CPU] = {};
+
+void __am_mpe_reserve() {
+  int n = cpu_count();
+  panic_on(n > MAX_CPU, "too many harts");
+  for (int i = 1; i < n; i ++) {
+    stack_top[i] = (uintptr_t)heap.end;
+    heap.end = (char *)heap.end - STACK_SIZE;
+  }
+}
+
+bool mpe_init(void (*entry)()) {
+  user_entry = entry;
+  __sync_synchronize();
+  for (int i = 1; i < cpu_count(); i ++) {
+    __am_mpe_sp[i] = stack_top[i];
+  }
+  __am_mpe_entry();
+  return true;
+}
+
+int cpu_count() {
+  int n;
+  asm volatile ("csrr %0, %1" : "=r"(n) : "i"(CSR_MNHART));
+  return n;
+}
+
+int cpu_current() {
+  int id;
+  asm volatile ("csrr %0, mhartid" : "=r"(id));
+  return id;
+}
+#else
+void __am_mpe_reserve() {
+}
+
+bool mpe_init(void (*entry)()) {
+  user_entry = entry;
+  __am_mpe_entry();
+  return true;
+}
+
 int cpu_count() {
   return 1;
 }
@@ -14,6 +70,7 @@ int cpu_count() {
 int cpu_current() {
   return 0;
 }
+#endif
 
 int atomic_xchg(int *addr, int newval) {
   return atomic_exchange(addr, newval);
@@ -3,6 +3,7 @@
 
 extern char _heap_start;
 int main(const char *args);
+void __am_mpe_reserve();
 
 Area heap = RANGE(&_heap_start, PMEM_END);
 static const char mainargs[MAINARGS_MAX_LEN] = TOSTRING(MAINARGS_PLACEHOLDER); // defined in CFLAGS
@@ -19,6 +20,7 @@ void halt(int code) {
 }
 
 void _trm_init() {
+  __am_mpe_reserve();
   int ret = main(mainargs);
   halt(ret);
 }
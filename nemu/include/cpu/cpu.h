@@ -19,10 +19,69 @@
 #include <common.h>
 
 void cpu_exec(uint64_t n);
+void cpu_exec_lean(uint64_t n);
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
 
+#ifdef CONFIG_IQUEUE
+// print the recent instructions
+void iqueue_dump();
+#endif
+
+#ifdef CONFIG_WATCHPOINT
+// the number of watchpoints reading registers, which are checked after every instruction
+extern int g_wp_nr_reg;
+void wp_check_reg();
+bool wp_any();
+#endif
+
+#ifdef CONFIG_BREAKPOINT
+// a bloom filter of the pcs of breakpoints, 0 if there is no breakpoint
+extern uint64_t g_bp_bloom;
+
+static inline uint64_t bp_bloom_bits(vaddr_t pc) {
+  uint32_t h = (uint32_t)(pc >> 2) * 0x9e3779b1u;
+  return (1ull << ((pc >> 2) & 63)) | (1ull << (h >> 26));
+}
+
+// true if there may be a breakpoint at `pc`
+static inline bool bp_maybe(vaddr_t pc) {
+  return g_bp_bloom != 0 && (g_bp_bloom & bp_bloom_bits(pc)) == bp_bloom_bits(pc);
+}
+
+// stop at the breakpoint at `pc` if there is one and its condition holds
+bool bp_check(vaddr_t pc);
+#endif
+// true if NEMU stops at a breakpoint before executing the instruction at `pc`
+#define bp_stop(pc) MUXDEF(CONFIG_BREAKPOINT, (unlikely(bp_maybe(pc)) && bp_check(pc)), false)
+
+#ifdef CONFIG_ENGINE_BLOCK
+// drop all blocks formed, as they are not checked for breakpoints inside
+void block_flush();
+#endif
+
+#ifdef CONFIG_MULTI_HART
+// whether the harts take turns by instructions on one thread in this run
+extern bool g_hart_lockstep;
+// whether the harts run on host threads at the same time in this run
+extern bool g_hart_threaded;
+// true on the threads of the harts other than the current one
+extern HART_LOCAL bool g_hart_worker;
+// set by --lockstep
+extern bool g_hart_lockstep_opt;
+void init_harts();
+// switch `cpu` to the next hart
+void hart_next();
+// run `n` instructions of every hart by `execute`
+void hart_exec(void (*execute)(uint64_t), uint64_t n);
+#endif
+
+#ifdef CONFIG_HAS_CLINT
+// take the interrupt pending between instructions, return true if one is taken
+bool cpu_check_intr();
+#endif
+
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
 
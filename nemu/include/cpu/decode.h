@@ -26,6 +26,11 @@ typedef struct Decode {
   IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
 
+#ifdef CONFIG_DECODE_CACHE
+// drop the cached decoding results of the instructions in [addr, addr + len)
+void decode_cache_invalidate(paddr_t addr, int len);
+#endif
+
 // --- pattern matching mechanism ---
 __attribute__((always_inline))
 static inline void pattern_decode(const char *str, int len,
@@ -87,6 +92,30 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+// In both modes `__instpat_end` is static, so that it is still valid when the execute
+// body of a pattern is entered directly from a cached decoding result
+#ifdef CONFIG_DECODE_TREE
+// Located at build/gen-$(GUEST_ISA)/decode-tree.h, which is generated by
+// tools/gen-decode from the INSTPAT patterns in src/isa/$(GUEST_ISA)/inst.c.
+// The decision tree selects the same pattern as the linear matching below,
+// and each pattern becomes a case labeled with its index in source order.
+#include <decode-tree.h>
+
+#define INSTPAT(pattern, ...) __INSTPAT_CASE(__COUNTER__, __VA_ARGS__)
+#define __INSTPAT_CASE(id, ...) \
+  case (id) - __instpat_base - 1: { \
+    INSTPAT_MATCH(s, __VA_ARGS__); \
+    goto *(__instpat_end); \
+  }
+
+#define INSTPAT_START(name) { static const void * const __instpat_end = &&concat(__instpat_end_, name); \
+  enum { __instpat_base = __COUNTER__ }; \
+  switch (concat(decode_tree_, __LINE__)(INSTPAT_INST(s))) {
+// check that the generated decision tree sees the same patterns
+#define INSTPAT_END(name) } \
+  concat(__instpat_end_, name): \
+  (void)sizeof(char[__COUNTER__ - __instpat_base - 1 == concat(DECODE_TREE_NR_, __LINE__) ? 1 : -1]); }
+#else
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
@@ -96,7 +125,8 @@ finish:
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void * __instpat_end = &&concat(__instpat_end_, name);
+#define INSTPAT_START(name) { static const void * const __instpat_end = &&concat(__instpat_end_, name);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
+#endif
 
 #endif
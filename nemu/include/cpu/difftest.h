@@ -24,13 +24,27 @@ void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_step_n(vaddr_t pc, vaddr_t npc, uint64_t n);
+void difftest_drain();
 void difftest_detach();
 void difftest_attach();
+#ifdef CONFIG_DIFFTEST_CHECKPOINT
+extern uint8_t *difftest_dirty; // one byte for each pmem page written since the checkpoint
+void difftest_save_page(paddr_t addr);
+#endif
+#if defined(CONFIG_BLOCK_JIT) && !defined(CONFIG_DIFFTEST_CHECKPOINT)
+void difftest_block_store(paddr_t addr, int len);
+#endif
+#ifdef CONFIG_DIFFTEST_PIPELINE
+void difftest_pipe_store(paddr_t addr, int len, word_t data);
+#endif
 #else
 static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_step_n(vaddr_t pc, vaddr_t npc, uint64_t n) {}
+static inline void difftest_drain() {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
@@ -39,6 +53,7 @@ extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direc
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
 extern void (*ref_difftest_raise_intr)(uint64_t NO);
+extern uint64_t (*ref_difftest_regcpy_dirty)(void *dut);
 
 static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref, word_t dut) {
   if (ref != dut) {
@@ -0,0 +1,50 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_PROFILE_H__
+#define __CPU_PROFILE_H__
+
+#include <common.h>
+
+#ifdef CONFIG_PROFILER
+enum { PROF_INST, PROF_LOAD, PROF_STORE, NR_PROF_CNT };
+
+extern bool g_prof_enable;
+extern uint64_t g_prof_cnt[NR_PROF_CNT];
+
+// keep the shadow call stack, called by the ISA on calls and returns
+void prof_call(vaddr_t pc, vaddr_t target);
+void prof_ret(vaddr_t target);
+
+void init_profiler(const char *elf_file, const char *prof_file, const char *func_file);
+void prof_dump();
+// write the outputs of the run in the `idx`-th forked child to FILE.idx
+void prof_set_index(int idx);
+
+#define prof_jump(is_call, is_ret, pc, target) do { \
+  if (unlikely(g_prof_enable)) { \
+    if (is_call) prof_call(pc, target); \
+    else if (is_ret) prof_ret(target); \
+  } \
+} while (0)
+
+// count the retired instructions and memory accesses for --func-stat
+#define prof_count(i) (g_prof_cnt[i] ++)
+#else
+#define prof_jump(is_call, is_ret, pc, target)
+#define prof_count(i)
+#endif
+
+#endif
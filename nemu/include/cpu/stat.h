@@ -0,0 +1,58 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_STAT_H__
+#define __CPU_STAT_H__
+
+#include <common.h>
+
+#ifdef CONFIG_INST_STAT
+typedef struct InstStat {
+  const char *name;
+  uint64_t cnt;
+  struct InstStat *next;
+} InstStat;
+
+enum { STAT_LOAD, STAT_STORE, STAT_BRANCH, STAT_TAKEN, NR_STAT_CNT };
+
+extern uint64_t g_stat_cnt[NR_STAT_CNT];
+// indexed by the width of the accesses in bytes
+extern uint64_t g_stat_load_width[9], g_stat_store_width[9];
+
+// add `s` to the histogram, on the first execution of its instruction
+void stat_register(InstStat *s);
+void stat_dump();
+
+// count an execution of the instruction named `inst`, with a counter of each call site
+#define stat_inst(inst) do { \
+  static InstStat __stat = { .name = str(inst) }; \
+  if (unlikely(__stat.cnt ++ == 0)) stat_register(&__stat); \
+} while (0)
+
+#define stat_branch(taken) do { \
+  g_stat_cnt[STAT_BRANCH] ++; \
+  g_stat_cnt[STAT_TAKEN] += (taken); \
+} while (0)
+
+#define stat_load(len)  do { g_stat_cnt[STAT_LOAD] ++;  g_stat_load_width[len] ++; } while (0)
+#define stat_store(len) do { g_stat_cnt[STAT_STORE] ++; g_stat_store_width[len] ++; } while (0)
+#else
+#define stat_inst(inst)
+#define stat_branch(taken)
+#define stat_load(len)
+#define stat_store(len)
+#endif
+
+#endif
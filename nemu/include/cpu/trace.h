@@ -0,0 +1,59 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_TRACE_H__
+#define __CPU_TRACE_H__
+
+#include <cpu/decode.h>
+
+// the pc and the raw bytes of an executed instruction
+typedef struct {
+  vaddr_t pc;
+  uint8_t inst[sizeof(((Decode *)0)->isa.inst)];
+  IFDEF(CONFIG_ISA_x86, uint8_t ilen); // other ISAs have fixed-length instructions
+} InstRecord;
+
+static inline void inst_record(InstRecord *r, Decode *s) {
+  r->pc = s->pc;
+  memcpy(r->inst, &s->isa.inst, sizeof(r->inst));
+  IFDEF(CONFIG_ISA_x86, r->ilen = s->snpc - s->pc);
+}
+
+#define inst_record_len(r) MUXDEF(CONFIG_ISA_x86, (r)->ilen, sizeof((r)->inst))
+
+// format the raw bytes and the assembly code of an instruction as a line of itrace
+void itrace_format(char *buf, int size, vaddr_t pc, uint8_t *inst, int ilen);
+
+#ifdef CONFIG_ITRACE_BINARY
+extern InstRecord *g_itrace_ptr, *g_itrace_end;
+
+void itrace_flip();
+
+// append a record to the page being filled, the full pages are written by another thread
+static inline void itrace_write(Decode *s) {
+  if (unlikely(g_itrace_ptr == g_itrace_end)) itrace_flip();
+  inst_record(g_itrace_ptr ++, s);
+}
+
+#define itrace_enabled() (g_itrace_ptr != NULL)
+
+void init_itrace(const char *file);
+// write the records left, this is also called at exit
+void itrace_close();
+// print the records in `file` as lines of itrace
+void itrace_decode(const char *file);
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+/* Device events are scheduled in retired guest instructions, so that the
+ * engines only compare g_nr_guest_inst with the time of the next event. */
+
+typedef struct Event {
+  const char *name;
+  uint64_t when; // the value of g_nr_guest_inst to fire at
+  void (*handler)(struct Event *e);
+  struct Event *next;
+} Event;
+
+extern HART_LOCAL uint64_t g_nr_guest_inst;
+extern uint64_t g_event_next;
+
+// fire `e` after `delay` more guest instructions, handlers reschedule their events to repeat
+void event_schedule(Event *e, uint64_t delay);
+void event_cancel(Event *e);
+void event_run();
+void init_event();
+
+#ifdef CONFIG_VIRTUAL_TIME
+#define VIRTUAL_US_TO_INST(us) ((uint64_t)(us) * CONFIG_VIRTUAL_TIME_MHZ)
+// guest time in us, derived from retired instructions
+static inline uint64_t virtual_time() { return g_nr_guest_inst / CONFIG_VIRTUAL_TIME_MHZ; }
+#endif
+
+static inline void device_update() {
+  if (unlikely(g_nr_guest_inst >= g_event_next)) event_run();
+}
+
+#endif
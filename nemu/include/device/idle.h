@@ -0,0 +1,39 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_IDLE_H__
+#define __DEVICE_IDLE_H__
+
+#include <common.h>
+
+/* A guest spinning on the timer or the keyboard is detected at its polling
+ * reads. Once an iteration of the loop leaves the registers and the memory
+ * unchanged, the loop can only exit after a device event, so the guest
+ * instructions until the next event are skipped. */
+
+extern bool g_idle_watch;
+extern uint64_t g_nr_idle_inst; // skipped guest instructions
+
+void idle_poll();
+void idle_reset();
+void idle_store(paddr_t addr, int len, word_t data);
+bool idle_check();
+void idle_statistic();
+
+// whether stores are checked for the loop being watched, the JIT leaves
+// the loop to the interpreter then
+#define idle_watching() (unlikely(g_idle_watch) && idle_check())
+
+#endif
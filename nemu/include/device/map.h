@@ -21,13 +21,17 @@
 typedef void(*io_callback_t)(uint32_t, int, bool);
 uint8_t* new_space(int size);
 
-typedef struct {
+typedef struct IOMap {
   const char *name;
   // we treat ioaddr_t as paddr_t here
   paddr_t low;
   paddr_t high;
   void *space;
   io_callback_t callback;
+  // REF can not model the device, so let it skip the instruction accessing the device
+  bool skip_ref;
+  // the guest may spin on reading it, see device/idle.h
+  bool idle_poll;
 } IOMap;
 
 static inline bool map_inside(IOMap *map, paddr_t addr) {
@@ -37,17 +41,14 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
 static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
   int i;
   for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
+    if (map_inside(maps + i, addr)) return i;
   }
   return -1;
 }
 
-void add_pio_map(const char *name, ioaddr_t addr,
+IOMap* add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
-void add_mmio_map(const char *name, paddr_t addr,
+IOMap* add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 
 word_t map_read(paddr_t addr, int len, IOMap *map);
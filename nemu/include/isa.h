@@ -29,9 +29,11 @@ extern unsigned char isa_logo[];
 void init_isa();
 
 // reg
-extern CPU_state cpu;
+extern HART_LOCAL CPU_state cpu;
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
+// where the register `name` is kept, NULL if it is not found or not kept as a word
+const word_t* isa_reg_str2ptr(const char *name);
 
 // exec
 struct Decode;
@@ -31,7 +31,41 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+#ifdef CONFIG_PMEM_CODE_TRACK
+/* mark the page containing `addr` as holding cached guest code,
+ * stores to such pages invalidate the decode cache and bump the
+ * generation of the page */
+void pmem_mark_code(paddr_t addr);
+/* generation of the page containing `addr`, 0 if it is not marked */
+uint32_t pmem_code_gen(paddr_t addr);
+/* the generations of all pages, indexed by (addr - CONFIG_MBASE) >> PAGE_SHIFT */
+const uint32_t* pmem_code_gen_table();
+#endif
+
+#ifdef CONFIG_WATCHPOINT
+/* add (`on`) or remove a watch on the page containing `addr` in pmem,
+ * stores to pages watched take the slow path and call wp_store() */
+void paddr_watch(paddr_t addr, bool on);
+/* check the watchpoints after a store to [addr, addr + len), implemented by sdb */
+void wp_store(paddr_t addr, int len);
+#endif
+
+#ifdef CONFIG_PMEM_MEMFD
+/* map pmem copy-on-write once the images are loaded */
+void pmem_seal();
+/* drop the pages written since pmem_seal() */
+void pmem_reset();
+#endif
+
+struct IOMap;
+/* map the guest physical range [addr, addr + len) to the host memory `host`,
+ * or to the device `map` if `host` is NULL */
+void paddr_add_region(const char *name, paddr_t addr, uint64_t len, uint8_t *host, struct IOMap *map);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
+/* copy `n` bytes between the guest and `buf` */
+void paddr_write_bulk(paddr_t addr, const void *buf, size_t n);
+void paddr_read_bulk(paddr_t addr, void *buf, size_t n);
 
 #endif
@@ -34,6 +34,28 @@ extern NEMUState nemu_state;
 
 uint64_t get_time();
 
+// ----------- snapshot -----------
+
+#ifdef CONFIG_SNAPSHOT
+// save the `len` bytes at `ptr` in snapshots, items are matched in the order of registration
+void snapshot_add(const char *name, void *ptr, size_t len);
+// `save` runs before taking a snapshot and `load` after restoring one, either can be NULL
+void snapshot_add_hook(void (*save)(), void (*load)());
+bool snapshot_save(const char *file);
+bool snapshot_load(const char *file);
+// keep the state in memory, and go back to it by snapshot_reset()
+void snapshot_mark();
+void snapshot_reset();
+#else
+static inline void snapshot_add(const char *name, void *ptr, size_t len) {}
+static inline void snapshot_add_hook(void (*save)(), void (*load)()) {}
+#endif
+
+// ----------- batch -----------
+
+// run each image in a child forked from the loaded state, return the number of failed runs
+int fork_images(int n, char *imgs[], FILE *json);
+
 // ----------- log -----------
 
 #define ANSI_FG_BLACK   "\33[1;30m"
@@ -16,6 +16,11 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <device/event.h>
+#include <device/idle.h>
+#include <cpu/profile.h>
+#include <cpu/stat.h>
+#include <cpu/trace.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -25,76 +30,145 @@
  */
 #define MAX_INST_TO_PRINT 51
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_inst = 0;
+HART_LOCAL CPU_state cpu = {};
+HART_LOCAL uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
-void device_update();
+#ifdef CONFIG_IQUEUE
+/* The recent instructions are kept in a ring as they are executed, and
+ * only disassembled when the ring is dumped on errors or by `info i'. */
+#define IQUEUE_MASK (CONFIG_IQUEUE_SIZE - 1)
+static_assert((CONFIG_IQUEUE_SIZE & IQUEUE_MASK) == 0, "CONFIG_IQUEUE_SIZE should be a power of 2");
 
-static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
-#ifdef CONFIG_ITRACE_COND
-  if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
-#endif
-  if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
-  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+static InstRecord iqueue[CONFIG_IQUEUE_SIZE];
+static uint64_t iqueue_nr = 0;
+static Decode *iqueue_cur = NULL; // the instruction being executed
+
+static inline void iqueue_push(Decode *s) {
+  inst_record(&iqueue[iqueue_nr ++ & IQUEUE_MASK], s);
+  iqueue_cur = NULL;
 }
 
-static void exec_once(Decode *s, vaddr_t pc) {
+void iqueue_dump() {
+  uint64_t i = (iqueue_nr > CONFIG_IQUEUE_SIZE ? iqueue_nr - CONFIG_IQUEUE_SIZE : 0);
+  char buf[128];
+  _Log("Recent instructions:\n");
+  for (; i < iqueue_nr; i ++) {
+    InstRecord *e = &iqueue[i & IQUEUE_MASK];
+    itrace_format(buf, sizeof(buf), e->pc, e->inst, inst_record_len(e));
+    _Log("%s %s\n", (i == iqueue_nr - 1 && iqueue_cur == NULL) ? "-->" : "   ", buf);
+  }
+  // an error raised in the middle of an instruction
+  Decode *s = iqueue_cur;
+  if (s == NULL) return;
+  if (s->snpc == s->pc) _Log("--> " FMT_WORD ": (failed to fetch)\n", s->pc);
+  else {
+    itrace_format(buf, sizeof(buf), s->pc, (uint8_t *)&s->isa.inst, s->snpc - s->pc);
+    _Log("--> %s\n", buf);
+  }
+}
+#endif
+
+void exec_once(Decode *s, vaddr_t pc) {
   s->pc = pc;
   s->snpc = pc;
+  prof_count(PROF_INST); // before a call or return is reported
+  IFDEF(CONFIG_IQUEUE, iqueue_cur = s);
   isa_exec_once(s);
   cpu.pc = s->dnpc;
+  IFDEF(CONFIG_IQUEUE, iqueue_push(s));
+  IFDEF(CONFIG_WATCHPOINT, if (unlikely(g_wp_nr_reg != 0)) wp_check_reg());
+}
+
+#ifdef CONFIG_HAS_CLINT
+bool cpu_check_intr() {
+  word_t intr = isa_query_intr();
+  if (intr == INTR_EMPTY) return false;
+  cpu.pc = isa_raise_intr(intr, cpu.pc);
+  return true;
+}
+#endif
+
+// the block engine is checked by DiffTest at block exits only when blocks may be
+// translated, or when REF is checked at checkpoints anyway
+#if defined(CONFIG_ENGINE_BLOCK) && !defined(CONFIG_ITRACE) && \
+  (!defined(CONFIG_DIFFTEST) || defined(CONFIG_BLOCK_JIT) || defined(CONFIG_DIFFTEST_CHECKPOINT))
+void block_execute(uint64_t n);
+
+static void execute(uint64_t n) {
+  block_execute(n);
+}
+#else
+static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
-  int ilen = s->snpc - s->pc;
-  int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst;
-#ifdef CONFIG_ISA_x86
-  for (i = 0; i < ilen; i ++) {
+  extern bool log_enable();
+#ifdef CONFIG_ITRACE_COND
+  bool to_log = ITRACE_COND && log_enable();
 #else
-  for (i = ilen - 1; i >= 0; i --) {
+  bool to_log = false;
+#endif
+#ifdef CONFIG_ITRACE_BINARY
+  if (to_log && itrace_enabled()) { itrace_write(_this); to_log = false; }
 #endif
-    p += snprintf(p, 4, " %02x", inst[i]);
+  if (to_log || g_print_step) {
+    itrace_format(_this->logbuf, sizeof(_this->logbuf), _this->pc,
+        (uint8_t *)&_this->isa.inst, _this->snpc - _this->pc);
+    if (to_log) log_write("%s\n", _this->logbuf);
+    if (g_print_step) puts(_this->logbuf);
   }
-  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-  int space_len = ilen_max - ilen;
-  if (space_len < 0) space_len = 0;
-  space_len = space_len * 3 + 1;
-  memset(p, ' ', space_len);
-  p += space_len;
-
-  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-  disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-      MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst, ilen);
 #endif
+  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
 }
 
+// also used by the block engine when instructions should be traced or checked one by one
 static void execute(uint64_t n) {
   Decode s;
+  bool first = true; // resume from a breakpoint
   for (;n > 0; n --) {
+    if (!first && bp_stop(cpu.pc)) break;
+    first = false;
     exec_once(&s, cpu.pc);
     // printf("s = %p, cpu.pc = " FMT_WORD "\n", &s, cpu.pc);
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    // devices are only updated on the main thread
+    IFDEF(CONFIG_DEVICE, if (MUXDEF(CONFIG_MULTI_HART, !g_hart_worker, true)) device_update());
+    IFDEF(CONFIG_HAS_CLINT, cpu_check_intr());
+    IFDEF(CONFIG_MULTI_HART, if (g_hart_lockstep) hart_next());
   }
 }
+#endif
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
   Log("host time spent = " NUMBERIC_FMT " us", g_timer);
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
-  if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
+  // skipped idle instructions are not simulated
+  uint64_t nr_sim_inst = g_nr_guest_inst - MUXDEF(CONFIG_IDLE_SKIP, g_nr_idle_inst, 0);
+  if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", nr_sim_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+  IFDEF(CONFIG_IDLE_SKIP, idle_statistic());
+  IFDEF(CONFIG_PROFILER, prof_dump());
+  IFDEF(CONFIG_INST_STAT, stat_dump());
 }
 
 void assert_fail_msg() {
+  IFDEF(CONFIG_IQUEUE, iqueue_dump());
+  IFDEF(CONFIG_ITRACE_BINARY, itrace_close());
   isa_reg_display();
   statistic();
+  fflush(stdout); // before abort()
+}
+
+/* Run `n` instructions without timing, state reports and statistics.
+ * This is called for every step when NEMU is the REF of DiffTest. */
+void cpu_exec_lean(uint64_t n) {
+  g_print_step = false;
+  nemu_state.state = NEMU_RUNNING;
+  execute(n);
 }
 
 /* Simulate how the CPU works. */
@@ -109,7 +183,8 @@ void cpu_exec(uint64_t n) {
 
   uint64_t timer_start = get_time();
 
-  execute(n);
+  MUXDEF(CONFIG_MULTI_HART, hart_exec(execute, n), execute(n));
+  difftest_drain();
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -123,6 +198,9 @@ void cpu_exec(uint64_t n) {
            (nemu_state.halt_ret == 0 ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN) :
             ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
           nemu_state.halt_pc);
+#ifdef CONFIG_IQUEUE
+      if (nemu_state.state == NEMU_ABORT || nemu_state.halt_ret != 0) iqueue_dump();
+#endif
       // fall through
     case NEMU_QUIT: statistic();
   }
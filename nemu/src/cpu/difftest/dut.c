@@ -17,7 +17,10 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -25,6 +28,7 @@ void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) =
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+uint64_t (*ref_difftest_regcpy_dirty)(void *dut) = NULL;
 
 #ifdef CONFIG_DIFFTEST
 
@@ -45,6 +49,402 @@ void difftest_skip_ref() {
   skip_dut_nr_inst = 0;
 }
 
+// the registers of REF kept across the steps, so that only the dirty
+// ones are copied if REF supports it
+static CPU_state ref_cpu;
+
+static CPU_state* ref_getregs() {
+  if (ref_difftest_regcpy_dirty != NULL) ref_difftest_regcpy_dirty(&ref_cpu);
+  else ref_difftest_regcpy(&ref_cpu, DIFFTEST_TO_DUT);
+  return &ref_cpu;
+}
+
+static void ref_setregs(CPU_state *r) {
+  ref_difftest_regcpy(r, DIFFTEST_TO_REF);
+  memcpy(&ref_cpu, r, DIFFTEST_REG_SIZE);
+}
+
+#ifdef CONFIG_DIFFTEST_CHECKPOINT
+/* REF is only run and checked at checkpoints, every CONFIG_DIFFTEST_INTERVAL
+ * instructions and around the steps accessing devices. A pmem page is saved
+ * before its first write after a checkpoint, so that on a mismatch both sides
+ * go back to the checkpoint and replay the instructions one by one to find
+ * the first wrong one. */
+
+typedef struct {
+  paddr_t addr;
+  uint8_t *data;
+} SavedPage;
+
+uint8_t *difftest_dirty = NULL; // one byte for each pmem page, set once it is saved
+static SavedPage *saved = NULL;
+static int nr_saved = 0, max_saved = 0;
+static CPU_state ckpt_cpu;   // DUT registers at the checkpoint
+static CPU_state last_cpu;   // DUT registers before the current step
+static uint64_t pending = 0; // DUT instructions not run by REF yet
+
+void exec_once(Decode *s, vaddr_t pc);
+
+void difftest_save_page(paddr_t addr) {
+  addr &= ~PAGE_MASK;
+  if (nr_saved == max_saved) {
+    max_saved = (max_saved == 0 ? 64 : max_saved * 2);
+    saved = realloc(saved, sizeof(SavedPage) * max_saved);
+    assert(saved);
+    memset(saved + nr_saved, 0, sizeof(SavedPage) * (max_saved - nr_saved));
+  }
+  SavedPage *p = &saved[nr_saved ++];
+  if (p->data == NULL) {
+    p->data = malloc(PAGE_SIZE);
+    assert(p->data);
+  }
+  p->addr = addr;
+  memcpy(p->data, guest_to_host(addr), PAGE_SIZE);
+  difftest_dirty[(addr - CONFIG_MBASE) >> PAGE_SHIFT] = 1;
+}
+
+static void ckpt_take() {
+  int i;
+  for (i = 0; i < nr_saved; i ++) {
+    difftest_dirty[(saved[i].addr - CONFIG_MBASE) >> PAGE_SHIFT] = 0;
+  }
+  nr_saved = 0;
+  pending = 0;
+  memcpy(&ckpt_cpu, &cpu, sizeof(cpu));
+  memcpy(&last_cpu, &cpu, sizeof(cpu));
+}
+
+// only the pages written since the checkpoint can differ
+static bool ckpt_checkmem() {
+  static uint8_t buf[PAGE_SIZE];
+  int i;
+  for (i = 0; i < nr_saved; i ++) {
+    paddr_t addr = saved[i].addr;
+    uint8_t *dut = guest_to_host(addr);
+    ref_difftest_memcpy(addr, buf, PAGE_SIZE, DIFFTEST_TO_DUT);
+    if (memcmp(buf, dut, PAGE_SIZE) == 0) continue;
+    int off = 0;
+    while (buf[off] == dut[off]) off ++;
+    Log("memory at " FMT_PADDR " is different, right = 0x%02x, wrong = 0x%02x",
+        addr + off, buf[off], dut[off]);
+    return false;
+  }
+  return true;
+}
+
+// run REF to the DUT registers `dut` and compare
+static bool ckpt_check(CPU_state *dut, bool checkmem) {
+  CPU_state cur;
+  ref_difftest_exec(pending);
+  CPU_state *ref_r = ref_getregs();
+  // isa_difftest_checkregs() compares with `cpu`
+  memcpy(&cur, &cpu, sizeof(cpu));
+  memcpy(&cpu, dut, sizeof(cpu));
+  bool ok = isa_difftest_checkregs(ref_r, dut->pc) && (!checkmem || ckpt_checkmem());
+  memcpy(&cpu, &cur, sizeof(cpu));
+  return ok;
+}
+
+static void ckpt_abort(vaddr_t pc) {
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+static void ckpt_replay() {
+  uint64_t nr = pending;
+  Log("REF is different within %" PRIu64 " instructions after the checkpoint at pc = " FMT_WORD
+      ", replay them one by one", nr, ckpt_cpu.pc);
+  int i;
+  for (i = 0; i < nr_saved; i ++) {
+    memcpy(guest_to_host(saved[i].addr), saved[i].data, PAGE_SIZE);
+    ref_difftest_memcpy(saved[i].addr, saved[i].data, PAGE_SIZE, DIFFTEST_TO_REF);
+  }
+  memcpy(&cpu, &ckpt_cpu, sizeof(cpu));
+  ref_setregs(&cpu);
+
+  nemu_state.state = NEMU_RUNNING;
+  while (nr -- > 0) {
+    Decode s;
+    vaddr_t pc = cpu.pc;
+    exec_once(&s, pc);
+    ref_difftest_exec(1);
+    CPU_state *ref_r = ref_getregs();
+    if (!isa_difftest_checkregs(ref_r, pc) || !ckpt_checkmem()) { ckpt_abort(pc); return; }
+  }
+  Log("the difference is not reproduced by the replay");
+  ckpt_abort(cpu.pc);
+}
+
+// check the pending instructions before the current one
+static void ckpt_flush() {
+  if (pending > 0 && !ckpt_check(&last_cpu, true)) { ckpt_replay(); return; }
+  pending = 0;
+}
+
+static void ckpt_step(uint64_t n) {
+  if (is_skip_ref) {
+    // REF is checked before the step, and then gets the results of the step.
+    // Stores of a block before its device access are not seen by REF yet.
+    if (pending > 0 && !ckpt_check(&last_cpu, n == 1)) { ckpt_replay(); return; }
+    ref_setregs(&cpu);
+    if (n > 1) {
+      int i;
+      for (i = 0; i < nr_saved; i ++) {
+        ref_difftest_memcpy(saved[i].addr, guest_to_host(saved[i].addr), PAGE_SIZE, DIFFTEST_TO_REF);
+      }
+    }
+    is_skip_ref = false;
+    ckpt_take();
+    return;
+  }
+
+  pending += n;
+  if (pending >= CONFIG_DIFFTEST_INTERVAL || nemu_state.state != NEMU_RUNNING) {
+    if (!ckpt_check(&cpu, true)) { ckpt_replay(); return; }
+    ckpt_take();
+    return;
+  }
+  memcpy(&last_cpu, &cpu, sizeof(cpu));
+}
+#endif
+
+#if defined(CONFIG_BLOCK_JIT) && !defined(CONFIG_DIFFTEST_CHECKPOINT)
+// pmem pages written by the current block, copied to REF if the block is skipped
+static paddr_t *blk_pages = NULL;
+static int nr_blk_pages = 0, max_blk_pages = 0;
+
+static void blk_page_add(paddr_t addr) {
+  addr &= ~PAGE_MASK;
+  int i;
+  for (i = nr_blk_pages - 1; i >= 0; i --) {
+    if (blk_pages[i] == addr) return;
+  }
+  if (nr_blk_pages == max_blk_pages) {
+    max_blk_pages = (max_blk_pages == 0 ? 16 : max_blk_pages * 2);
+    blk_pages = realloc(blk_pages, sizeof(paddr_t) * max_blk_pages);
+    assert(blk_pages);
+  }
+  blk_pages[nr_blk_pages ++] = addr;
+}
+
+void difftest_block_store(paddr_t addr, int len) {
+  paddr_t last = addr + len - 1;
+  if (in_pmem(addr)) blk_page_add(addr);
+  if ((addr >> PAGE_SHIFT) != (last >> PAGE_SHIFT) && in_pmem(last)) blk_page_add(last);
+}
+
+static void blk_sync_pages() {
+  int i;
+  for (i = 0; i < nr_blk_pages; i ++) {
+    ref_difftest_memcpy(blk_pages[i], guest_to_host(blk_pages[i]), PAGE_SIZE, DIFFTEST_TO_REF);
+  }
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_PIPELINE
+/* DUT pushes a record of every instruction, with the register words and the
+ * pmem it writes, into a single-producer single-consumer ring. A REF thread
+ * steps REF and checks the records against a mirror of the DUT registers
+ * rebuilt from them, so DUT only waits for REF when the ring is full. A
+ * mismatch is reported when DUT sees it, maybe some instructions later. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define NR_DIFF_REG (DIFFTEST_REG_SIZE / sizeof(word_t))
+#define RING_SIZE 4096 // must be a power of 2
+#define NO_REG 0xff
+#define MLEN_MULTI 0xff // more than one store, which is not checked
+
+enum { COMMIT_STEP, COMMIT_SKIP, COMMIT_REG };
+
+typedef struct {
+  uint8_t type;
+  uint8_t mlen;   // bytes stored to pmem, 0 for none
+  uint8_t idx[2]; // register words written, NO_REG for none
+  vaddr_t pc;
+  word_t val[2];
+  paddr_t maddr;
+  word_t mdata;
+} Commit;
+
+static Commit ring[RING_SIZE];
+// on different cache lines, since they are written by different threads
+static _Atomic uint64_t ring_head __attribute__((aligned(64))) = 0; // written by DUT
+static _Atomic uint64_t ring_tail __attribute__((aligned(64))) = 0; // written by REF
+static uint64_t tail_seen = 0; // the last tail read by DUT
+static word_t dut_shadow[NR_DIFF_REG]; // DUT registers at the last record
+static word_t ref_mirror[NR_DIFF_REG]; // DUT registers rebuilt by REF
+static uint8_t st_len = 0;
+static paddr_t st_addr = 0;
+static word_t st_data = 0;
+
+// the first mismatch found by REF
+static _Atomic bool ref_failed = false;
+static struct {
+  vaddr_t pc;
+  const char *what;
+  word_t where, ref, dut;
+} fail;
+
+void difftest_pipe_store(paddr_t addr, int len, word_t data) {
+  if (!in_pmem(addr)) return;
+  if (st_len != 0) { st_len = MLEN_MULTI; return; }
+  st_len = len; st_addr = addr; st_data = data;
+}
+
+static void ring_push(Commit *c) {
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  while (head - tail_seen == RING_SIZE) {
+    tail_seen = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (head - tail_seen == RING_SIZE) sched_yield();
+  }
+  ring[head & (RING_SIZE - 1)] = *c;
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+static void ref_fail(vaddr_t pc, const char *what, word_t where, word_t ref, word_t dut) {
+  fail.pc = pc; fail.what = what; fail.where = where; fail.ref = ref; fail.dut = dut;
+  atomic_store_explicit(&ref_failed, true, memory_order_release);
+}
+
+static bool ref_check(Commit *c, word_t *mirror) {
+  if (c->type == COMMIT_SKIP) { ref_setregs((CPU_state *)mirror); return true; }
+
+  ref_difftest_exec(1);
+  word_t *ref = (word_t *)ref_getregs();
+  if (memcmp(ref, mirror, DIFFTEST_REG_SIZE) != 0) {
+    int i = 0;
+    while (ref[i] == mirror[i]) i ++;
+    ref_fail(c->pc, "register word", i, ref[i], mirror[i]);
+    return false;
+  }
+  if (c->mlen != 0 && c->mlen != MLEN_MULTI) {
+    word_t data = 0, mask = (c->mlen == sizeof(word_t) ? (word_t)-1 : ((word_t)1 << (c->mlen * 8)) - 1);
+    ref_difftest_memcpy(c->maddr, &data, c->mlen, DIFFTEST_TO_DUT);
+    if (data != (c->mdata & mask)) {
+      ref_fail(c->pc, "memory at", c->maddr, data, c->mdata & mask);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool ref_ok = true; // false after a mismatch, written by REF
+
+static void* ref_thread(void *arg) {
+  word_t *mirror = ref_mirror;
+  uint64_t tail = 0;
+  int idle = 0;
+  while (true) {
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    if (tail == head) {
+      // back off when DUT is stopped
+      if (++ idle > 1000) usleep(100);
+      else sched_yield();
+      continue;
+    }
+    idle = 0;
+    for (; tail != head; tail ++) {
+      Commit *c = &ring[tail & (RING_SIZE - 1)];
+      int k;
+      for (k = 0; k < 2; k ++) {
+        if (c->idx[k] != NO_REG) mirror[c->idx[k]] = c->val[k];
+      }
+      // records after a mismatch are only consumed
+      if (ref_ok && c->type != COMMIT_REG) ref_ok = ref_check(c, mirror);
+    }
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void pipe_report() {
+  Log("%s " FMT_WORD " is different after executing instruction at pc = " FMT_WORD
+      ", right = " FMT_WORD ", wrong = " FMT_WORD ", found by REF when DUT is at pc = " FMT_WORD,
+      fail.what, fail.where, fail.pc, fail.ref, fail.dut, cpu.pc);
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = fail.pc;
+  atomic_store_explicit(&ref_failed, false, memory_order_relaxed); // report it once
+}
+
+// wait for REF to check all records
+static void pipe_drain() {
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  while (atomic_load_explicit(&ring_tail, memory_order_acquire) != head &&
+      !atomic_load_explicit(&ref_failed, memory_order_acquire)) sched_yield();
+  if (atomic_load_explicit(&ref_failed, memory_order_acquire)) pipe_report();
+}
+
+static void pipe_step(vaddr_t pc) {
+  word_t *r = (word_t *)&cpu;
+  Commit c = { .type = COMMIT_REG, .idx = { NO_REG, NO_REG } };
+  int i, n = 0;
+  for (i = 0; i < NR_DIFF_REG; i ++) {
+    if (r[i] == dut_shadow[i]) continue;
+    dut_shadow[i] = r[i];
+    if (n == 2) {
+      // the words before the last two go in records of their own
+      ring_push(&c);
+      c.idx[0] = c.idx[1] = NO_REG;
+      n = 0;
+    }
+    c.idx[n] = i;
+    c.val[n ++] = r[i];
+  }
+  c.type = (is_skip_ref ? COMMIT_SKIP : COMMIT_STEP);
+  c.pc = pc;
+  c.mlen = st_len; c.maddr = st_addr; c.mdata = st_data;
+  ring_push(&c);
+  st_len = 0;
+  is_skip_ref = false;
+
+  if (unlikely(atomic_load_explicit(&ref_failed, memory_order_acquire))) pipe_report();
+  else if (nemu_state.state != NEMU_RUNNING) pipe_drain();
+}
+
+// wait for REF to consume every record, and check again from the DUT registers
+static void pipe_reset() {
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  while (atomic_load_explicit(&ring_tail, memory_order_acquire) != head) sched_yield();
+  // REF is idle and sees these with the next record
+  atomic_store_explicit(&ref_failed, false, memory_order_relaxed);
+  ref_ok = true;
+  st_len = 0;
+  memcpy(dut_shadow, &cpu, DIFFTEST_REG_SIZE);
+  memcpy(ref_mirror, &cpu, DIFFTEST_REG_SIZE);
+}
+
+static void pipe_start() {
+  pthread_t t;
+  int ret = pthread_create(&t, NULL, ref_thread, NULL);
+  Assert(ret == 0, "can not create the REF thread");
+  pthread_detach(t);
+}
+
+// the REF thread is not inherited by a child, which starts its own with an
+// empty ring, and then brings REF to its state by difftest_attach()
+static void pipe_forked() {
+  atomic_store_explicit(&ring_head, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring_tail, 0, memory_order_relaxed);
+  atomic_store_explicit(&ref_failed, false, memory_order_relaxed);
+  tail_seen = 0;
+  ref_ok = true;
+  pipe_start();
+}
+
+static void pipe_init() {
+  memcpy(dut_shadow, &cpu, DIFFTEST_REG_SIZE);
+  memcpy(ref_mirror, &cpu, DIFFTEST_REG_SIZE);
+  pipe_start();
+  pthread_atfork(NULL, NULL, pipe_forked);
+  Log("REF is checked in another thread");
+}
+#endif
+
 // this is used to deal with instruction packing in QEMU.
 // Sometimes letting QEMU step once will execute multiple instructions.
 // We should skip checking until NEMU's pc catches up with QEMU's pc.
@@ -52,7 +452,9 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, panic("skipping DUT instructions is not supported by the DiffTest pipeline"));
   skip_dut_nr_inst += nr_dut;
+  IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_flush());
 
   while (nr_ref -- > 0) {
     ref_difftest_exec(1);
@@ -78,6 +480,9 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   ref_difftest_raise_intr = dlsym(handle, "difftest_raise_intr");
   assert(ref_difftest_raise_intr);
 
+  // optional, REF copies all registers without it
+  ref_difftest_regcpy_dirty = dlsym(handle, "difftest_regcpy_dirty");
+
   void (*ref_difftest_init)(int) = dlsym(handle, "difftest_init");
   assert(ref_difftest_init);
 
@@ -88,7 +493,30 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
 
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
-  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  ref_setregs(&cpu);
+
+#ifdef CONFIG_DIFFTEST_CHECKPOINT
+  difftest_dirty = calloc(CONFIG_MSIZE >> PAGE_SHIFT, 1);
+  assert(difftest_dirty);
+  ckpt_take();
+  Log("REF is checked every %d instructions", CONFIG_DIFFTEST_INTERVAL);
+#endif
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_init());
+}
+
+// called when DUT stops, so that REF is up to date
+void difftest_drain() {
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_drain());
+}
+
+// bring REF to the state of DUT, e.g. after restoring a snapshot
+void difftest_attach() {
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_reset());
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  ref_setregs(&cpu);
+  IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_take());
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -100,32 +528,69 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
 }
 
 void difftest_step(vaddr_t pc, vaddr_t npc) {
-  CPU_state ref_r;
+  CPU_state *ref_r;
+
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, pipe_step(pc); return);
 
   if (skip_dut_nr_inst > 0) {
-    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
-    if (ref_r.pc == npc) {
+    ref_r = ref_getregs();
+    if (ref_r->pc == npc) {
       skip_dut_nr_inst = 0;
-      checkregs(&ref_r, npc);
+      checkregs(ref_r, npc);
+      IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_take());
       return;
     }
     skip_dut_nr_inst --;
     if (skip_dut_nr_inst == 0)
-      panic("can not catch up with ref.pc = " FMT_WORD " at pc = " FMT_WORD, ref_r.pc, pc);
+      panic("can not catch up with ref.pc = " FMT_WORD " at pc = " FMT_WORD, ref_r->pc, pc);
     return;
   }
 
+  IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_step(1); return);
+
   if (is_skip_ref) {
     // to skip the checking of an instruction, just copy the reg state to reference design
-    ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+    ref_setregs(&cpu);
     is_skip_ref = false;
     return;
   }
 
   ref_difftest_exec(1);
-  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  ref_r = ref_getregs();
+
+  checkregs(ref_r, pc);
+}
+
+// check `n` instructions starting at `pc` at once, used by the block engine
+void difftest_step_n(vaddr_t pc, vaddr_t npc, uint64_t n) {
+  CPU_state *ref_r;
+
+#if defined(CONFIG_BLOCK_JIT) && !defined(CONFIG_DIFFTEST_CHECKPOINT)
+  // REF writes the same pages by itself unless the block is skipped
+  if (is_skip_ref && n > 1) blk_sync_pages();
+  nr_blk_pages = 0;
+#endif
+
+  if (n == 1 || skip_dut_nr_inst > 0) {
+    Assert(n == 1, "can not skip DUT instructions when checking a block at pc = " FMT_WORD, pc);
+    difftest_step(pc, npc);
+    return;
+  }
+
+  IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_step(n); return);
+
+  if (is_skip_ref) {
+    // the block accessed devices, so the whole block is skipped, and REF
+    // gets the pmem pages it wrote above
+    ref_setregs(&cpu);
+    is_skip_ref = false;
+    return;
+  }
+
+  ref_difftest_exec(n);
+  ref_r = ref_getregs();
 
-  checkregs(&ref_r, pc);
+  checkregs(ref_r, pc);
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
@@ -21,17 +21,18 @@
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     // 从DUT复制到REF
-    for (size_t i = 0; i < n; i++) {
-      paddr_write(addr + i, 1, *((uint8_t*)buf + i));
-    }
+    paddr_write_bulk(addr, buf, n);
   } else {
     // 从REF复制到DUT
-    for (size_t i = 0; i < n; i++) {
-      *((uint8_t*)buf + i) = paddr_read(addr + i, 1);
-    }
+    paddr_read_bulk(addr, buf, n);
   }
 }
 
+#define NR_DIFF_REG (DIFFTEST_REG_SIZE / sizeof(word_t))
+
+// the registers at the last copy with DUT, to find the dirty ones
+static word_t shadow[NR_DIFF_REG];
+
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
   // CPU_state *r = (CPU_state *)dut;
   if (direction == DIFFTEST_TO_REF) {
@@ -41,10 +42,26 @@ __EXPORT void difftest_regcpy(void *dut, bool direction) {
     // 从REF复制寄存器状态到DUT
     memcpy(dut, &cpu, DIFFTEST_REG_SIZE);
   }
+  memcpy(shadow, &cpu, DIFFTEST_REG_SIZE);
+}
+
+// copy to `dut`, which holds the registers of the last copy, only those
+// changed since then, and return the mask of them
+__EXPORT uint64_t difftest_regcpy_dirty(void *dut) {
+  word_t *r = (word_t *)&cpu, *d = dut;
+  uint64_t mask = 0;
+  int i;
+  for (i = 0; i < NR_DIFF_REG; i ++) {
+    if (r[i] != shadow[i]) {
+      d[i] = shadow[i] = r[i];
+      mask |= 1ull << i;
+    }
+  }
+  return mask;
 }
 
 __EXPORT void difftest_exec(uint64_t n) {
-  cpu_exec(n);
+  cpu_exec_lean(n);
 }
 
 __EXPORT void difftest_raise_intr(word_t NO) {
@@ -56,4 +73,5 @@ __EXPORT void difftest_init(int port) {
   init_mem();
   /* Perform ISA dependent initialization. */
   init_isa();
+  assert(NR_DIFF_REG <= 64);
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <device/event.h>
+#include <pthread.h>
+
+#ifdef CONFIG_MULTI_HART
+/* The harts share the memory and the devices, and `cpu` is the state of
+ * the hart running on this thread. A run to the end with nothing to stop
+ * at puts every hart on a host thread. Otherwise the harts take turns one
+ * instruction each on the main thread, in the order of their ids, which is
+ * deterministic and makes `si', watchpoints and breakpoints work. */
+
+static CPU_state harts[CONFIG_NR_HART];
+static int cur = 0; // the hart in `cpu` on the main thread
+
+bool g_hart_lockstep_opt = false;
+bool g_hart_lockstep = false;
+bool g_hart_threaded = false;
+HART_LOCAL bool g_hart_worker = false;
+
+void init_harts() {
+  int i;
+  for (i = 0; i < CONFIG_NR_HART; i ++) {
+    harts[i] = cpu;
+    harts[i].mhartid = i;
+  }
+  cur = 0;
+  Log("%d harts, %s", CONFIG_NR_HART, g_hart_lockstep_opt ? "in lockstep" : "on host threads when running freely");
+}
+
+void hart_next() {
+  harts[cur] = cpu;
+  cur = (cur + 1) % CONFIG_NR_HART;
+  cpu = harts[cur];
+}
+
+typedef struct {
+  pthread_t thread;
+  int id;
+  void (*execute)(uint64_t);
+  uint64_t n;
+  uint64_t nr_inst;
+} Worker;
+
+static void* hart_worker(void *arg) {
+  Worker *w = arg;
+  g_hart_worker = true;
+  cpu = harts[w->id];
+  w->execute(w->n);
+  harts[w->id] = cpu;
+  w->nr_inst = g_nr_guest_inst;
+  return NULL;
+}
+
+static bool hart_can_thread(uint64_t n) {
+  if (MUXDEF(CONFIG_VIRTUAL_TIME, true, false) || g_hart_lockstep_opt || n != (uint64_t)-1) return false;
+  if (MUXDEF(CONFIG_BREAKPOINT, g_bp_bloom != 0, false)) return false;
+  if (MUXDEF(CONFIG_WATCHPOINT, wp_any(), false)) return false;
+  return true;
+}
+
+void hart_exec(void (*execute)(uint64_t), uint64_t n) {
+  if (!hart_can_thread(n)) {
+    g_hart_lockstep = true;
+    execute(n);
+    g_hart_lockstep = false;
+    return;
+  }
+
+  Worker w[CONFIG_NR_HART];
+  int i;
+  harts[cur] = cpu;
+  g_hart_threaded = true;
+  for (i = 0; i < CONFIG_NR_HART; i ++) {
+    if (i == cur) continue;
+    w[i] = (Worker) { .id = i, .execute = execute, .n = n };
+    Assert(pthread_create(&w[i].thread, NULL, hart_worker, &w[i]) == 0, "can not create the thread of hart %d", i);
+  }
+  execute(n);
+  for (i = 0; i < CONFIG_NR_HART; i ++) {
+    if (i == cur) continue;
+    pthread_join(w[i].thread, NULL);
+    g_nr_guest_inst += w[i].nr_inst;
+  }
+  g_hart_threaded = false;
+}
+#endif
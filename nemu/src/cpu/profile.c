@@ -0,0 +1,380 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/profile.h>
+#include <device/event.h>
+
+#ifdef CONFIG_PROFILER
+#include <elf.h>
+
+/* The guest pc is sampled every CONFIG_PROFILER_INTERVAL instructions by a
+ * device event, together with a shadow call stack kept from the calls and
+ * returns reported by the ISA. Samples with the same stack are counted
+ * together, and written in the folded format of flamegraph.pl as
+ * "outer;...;inner count", with the functions named by the ELF symbols.
+ *
+ * With --func-stat, the retired instructions, loads and stores counted in
+ * g_prof_cnt[] are also charged to the function on the top of the stack
+ * whenever the stack changes, and to every function on the stack as its
+ * inclusive counts when it returns. */
+
+#define MAX_DEPTH 128
+#define NR_BUCKET 4096
+#define NR_TOP 10
+
+bool g_prof_enable = false;
+uint64_t g_prof_cnt[NR_PROF_CNT] = {};
+
+typedef struct {
+  vaddr_t entry; // the function called
+  vaddr_t ret;   // the address to return to
+  int func;      // index in funcs[]
+  uint64_t base[NR_PROF_CNT]; // g_prof_cnt[] when called
+} Frame;
+
+// stack[0] is the function running when the profiler starts, and never returns
+static Frame stack[MAX_DEPTH];
+static int depth = 0;
+static uint64_t overflow = 0; // calls not kept on the full stack
+
+typedef struct {
+  vaddr_t entry;
+  uint64_t self[NR_PROF_CNT];
+  uint64_t incl[NR_PROF_CNT];
+  int active; // frames on the stack, the inclusive counts are for the outermost one
+} Func;
+
+static Func *funcs = NULL;
+static int nr_func = 0;
+static bool func_stat = false;
+static uint64_t last_cnt[NR_PROF_CNT] = {};
+
+static int func_get(vaddr_t target);
+
+// charge the counts since the last change of the stack to the top function
+static void func_account() {
+  Func *f = &funcs[stack[depth - 1].func];
+  int i;
+  for (i = 0; i < NR_PROF_CNT; i ++) {
+    f->self[i] += g_prof_cnt[i] - last_cnt[i];
+    last_cnt[i] = g_prof_cnt[i];
+  }
+}
+
+static void frame_push(vaddr_t entry, vaddr_t ret) {
+  Frame *fr = &stack[depth ++];
+  fr->entry = entry;
+  fr->ret = ret;
+  if (func_stat) {
+    fr->func = func_get(entry);
+    funcs[fr->func].active ++;
+    memcpy(fr->base, g_prof_cnt, sizeof(fr->base));
+  }
+}
+
+static void frame_pop(Frame *fr) {
+  if (!func_stat) return;
+  Func *f = &funcs[fr->func];
+  if (-- f->active > 0) return;
+  int i;
+  for (i = 0; i < NR_PROF_CNT; i ++) f->incl[i] += g_prof_cnt[i] - fr->base[i];
+}
+
+void prof_call(vaddr_t pc, vaddr_t target) {
+  if (func_stat) func_account();
+  if (depth == MAX_DEPTH) {
+    // in a deep recursion, the innermost frames are charged to the last one kept
+    overflow ++;
+    return;
+  }
+  frame_push(target, pc + 4);
+}
+
+void prof_ret(vaddr_t target) {
+  if (func_stat) func_account();
+  if (overflow > 0) { overflow --; return; }
+  // frames left by longjmp() and the like are dropped together
+  int i, to = depth - 1;
+  for (i = depth - 1; i >= 1; i --) {
+    if (stack[i].ret == target) { to = i; break; }
+  }
+  if (to < 1) return;
+  while (depth > to) frame_pop(&stack[-- depth]);
+}
+
+// ----------- symbols -----------
+
+typedef struct {
+  vaddr_t addr;
+  word_t size;
+  char *name;
+} Symbol;
+
+static Symbol *syms = NULL;
+static int nr_sym = 0;
+
+static int sym_cmp(const void *a, const void *b) {
+  vaddr_t x = ((Symbol *)a)->addr, y = ((Symbol *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+#define Elf_Ehdr MUXDEF(CONFIG_ISA64, Elf64_Ehdr, Elf32_Ehdr)
+#define Elf_Shdr MUXDEF(CONFIG_ISA64, Elf64_Shdr, Elf32_Shdr)
+#define Elf_Sym  MUXDEF(CONFIG_ISA64, Elf64_Sym , Elf32_Sym )
+#define ELF_ST_TYPE MUXDEF(CONFIG_ISA64, ELF64_ST_TYPE, ELF32_ST_TYPE)
+
+static void load_symbols(const char *elf_file) {
+  FILE *fp = fopen(elf_file, "rb");
+  Assert(fp, "Can not open '%s'", elf_file);
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  uint8_t *buf = malloc(size);
+  assert(buf);
+  fseek(fp, 0, SEEK_SET);
+  int ret = fread(buf, size, 1, fp);
+  assert(ret == 1);
+  fclose(fp);
+
+  Elf_Ehdr *eh = (Elf_Ehdr *)buf;
+  Assert(size >= sizeof(*eh) && memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 &&
+      eh->e_ident[EI_CLASS] == MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32),
+      "'%s' is not an ELF file of the guest", elf_file);
+  Assert(eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf_Shdr) <= size, "'%s' is truncated", elf_file);
+  Elf_Shdr *sh = (Elf_Shdr *)(buf + eh->e_shoff);
+  int i, j;
+  for (i = 0; i < eh->e_shnum; i ++) {
+    if (sh[i].sh_type != SHT_SYMTAB) continue;
+    Elf_Sym *sym = (Elf_Sym *)(buf + sh[i].sh_offset);
+    const char *strtab = (const char *)buf + sh[sh[i].sh_link].sh_offset;
+    int n = sh[i].sh_size / sizeof(Elf_Sym);
+    syms = realloc(syms, sizeof(Symbol) * (nr_sym + n));
+    assert(syms);
+    for (j = 0; j < n; j ++) {
+      if (ELF_ST_TYPE(sym[j].st_info) != STT_FUNC) continue;
+      syms[nr_sym ++] = (Symbol) { .addr = sym[j].st_value, .size = sym[j].st_size,
+        .name = strdup(strtab + sym[j].st_name) };
+    }
+  }
+  free(buf);
+  qsort(syms, nr_sym, sizeof(Symbol), sym_cmp);
+  Log("Profiler: %d functions in %s", nr_sym, elf_file);
+}
+
+static Symbol* find_symbol(vaddr_t pc) {
+  int l = 0, r = nr_sym - 1;
+  Symbol *s = NULL;
+  while (l <= r) {
+    int m = (l + r) / 2;
+    if (syms[m].addr <= pc) { s = &syms[m]; l = m + 1; }
+    else r = m - 1;
+  }
+  // functions of size 0 are from assembly without .size
+  return (s != NULL && (s->size == 0 || pc - s->addr < s->size) ? s : NULL);
+}
+
+// the entry of the function containing `pc`, or `pc` itself
+static vaddr_t func_of(vaddr_t pc) {
+  Symbol *s = find_symbol(pc);
+  return (s != NULL ? s->addr : pc);
+}
+
+static int func_get(vaddr_t target) {
+  // the callee of a call site rarely changes, so remember the last lookup
+  static struct { vaddr_t target; int func; } cache[NR_BUCKET];
+  static bool cache_valid[NR_BUCKET] = {};
+  int h = (target >> 2) % NR_BUCKET;
+  if (cache_valid[h] && cache[h].target == target) return cache[h].func;
+
+  vaddr_t entry = func_of(target);
+  int i;
+  for (i = 0; i < nr_func; i ++) {
+    if (funcs[i].entry == entry) break;
+  }
+  if (i == nr_func) {
+    funcs = realloc(funcs, sizeof(Func) * (nr_func + 1));
+    assert(funcs);
+    funcs[nr_func ++] = (Func) { .entry = entry };
+  }
+  cache[h].target = target;
+  cache[h].func = i;
+  cache_valid[h] = true;
+  return i;
+}
+
+// ----------- samples -----------
+
+typedef struct Sample {
+  uint32_t hash;
+  int depth;
+  vaddr_t *funcs; // from the outermost
+  uint64_t count;
+  struct Sample *next;
+} Sample;
+
+static Sample *bucket[NR_BUCKET] = {};
+static const char *out_file = NULL;
+static const char *stat_file = NULL;
+static uint64_t last_inst = 0;
+
+static void prof_sample(vaddr_t pc, uint64_t weight) {
+  vaddr_t funcs[MAX_DEPTH + 1];
+  int n = 0, i;
+  uint32_t hash = 2166136261u;
+  for (i = 0; i <= depth; i ++) {
+    vaddr_t f;
+    if (i < depth) f = func_of(stack[i].entry);
+    else {
+      // without a symbol, pc is taken to be in the function called last
+      Symbol *sym = find_symbol(pc);
+      f = (sym != NULL ? sym->addr : (n > 0 ? funcs[n - 1] : pc));
+      if (n > 0 && funcs[n - 1] == f) break;
+    }
+    funcs[n ++] = f;
+    hash = (hash ^ f) * 16777619u;
+  }
+
+  Sample **b = &bucket[hash % NR_BUCKET], *s;
+  for (s = *b; s != NULL; s = s->next) {
+    if (s->hash == hash && s->depth == n && memcmp(s->funcs, funcs, sizeof(vaddr_t) * n) == 0) {
+      s->count += weight;
+      return;
+    }
+  }
+  s = malloc(sizeof(Sample));
+  assert(s);
+  s->funcs = malloc(sizeof(vaddr_t) * n);
+  assert(s->funcs);
+  memcpy(s->funcs, funcs, sizeof(vaddr_t) * n);
+  s->hash = hash;
+  s->depth = n;
+  s->count = weight;
+  s->next = *b;
+  *b = s;
+}
+
+// the instructions skipped by idle loops or run by a block count as well
+static void prof_tick(Event *e) {
+  uint64_t weight = (g_nr_guest_inst - last_inst) / CONFIG_PROFILER_INTERVAL;
+  if (weight == 0) weight = 1;
+  last_inst = g_nr_guest_inst;
+  prof_sample(cpu.pc, weight);
+  event_schedule(e, CONFIG_PROFILER_INTERVAL);
+}
+
+static Event prof_event = { .name = "profiler", .handler = prof_tick };
+
+static const char *func_name(vaddr_t entry, char *buf, size_t size) {
+  Symbol *sym = find_symbol(entry);
+  if (sym != NULL) return sym->name;
+  snprintf(buf, size, FMT_WORD, entry);
+  return buf;
+}
+
+static void sample_dump() {
+  FILE *fp = fopen(out_file, "w");
+  Assert(fp, "Can not open '%s'", out_file);
+  int i, j, nr = 0;
+  uint64_t total = 0;
+  char buf[32];
+  Sample *s;
+  for (i = 0; i < NR_BUCKET; i ++) {
+    for (s = bucket[i]; s != NULL; s = s->next) {
+      for (j = 0; j < s->depth; j ++) {
+        fprintf(fp, "%s%s", j == 0 ? "" : ";", func_name(s->funcs[j], buf, sizeof(buf)));
+      }
+      fprintf(fp, " %" PRIu64 "\n", s->count);
+      total += s->count;
+      nr ++;
+    }
+  }
+  fclose(fp);
+  Log("Profiler: %" PRIu64 " samples of %d stacks are written to %s", total, nr, out_file);
+}
+
+// the heaviest function by its own instructions first
+static int func_cmp(const void *a, const void *b) {
+  const Func *x = a, *y = b;
+  return (x->self[PROF_INST] < y->self[PROF_INST]) - (x->self[PROF_INST] > y->self[PROF_INST]);
+}
+
+static void func_stat_dump() {
+  // the frames still on the stack return here
+  func_account();
+  while (depth > 0) frame_pop(&stack[-- depth]);
+  func_stat = false;
+  qsort(funcs, nr_func, sizeof(Func), func_cmp);
+
+  uint64_t total = g_prof_cnt[PROF_INST];
+  char buf[32];
+  int i;
+  Log("Profiler: top %d of %d functions by instructions", (nr_func < NR_TOP ? nr_func : NR_TOP), nr_func);
+  Log("%-24s %14s %6s %14s %12s %12s", "function", "self inst", "%", "total inst", "self load", "self store");
+  for (i = 0; i < nr_func && i < NR_TOP; i ++) {
+    Func *f = &funcs[i];
+    Log("%-24s %14" PRIu64 " %5.1f%% %14" PRIu64 " %12" PRIu64 " %12" PRIu64,
+        func_name(f->entry, buf, sizeof(buf)), f->self[PROF_INST],
+        total == 0 ? 0.0 : f->self[PROF_INST] * 100.0 / total,
+        f->incl[PROF_INST], f->self[PROF_LOAD], f->self[PROF_STORE]);
+  }
+
+  FILE *fp = fopen(stat_file, "w");
+  Assert(fp, "Can not open '%s'", stat_file);
+  fprintf(fp, "function,entry,inst,load,store,total_inst,total_load,total_store\n");
+  for (i = 0; i < nr_func; i ++) {
+    Func *f = &funcs[i];
+    fprintf(fp, "%s," FMT_WORD ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+        func_name(f->entry, buf, sizeof(buf)), f->entry,
+        f->self[PROF_INST], f->self[PROF_LOAD], f->self[PROF_STORE],
+        f->incl[PROF_INST], f->incl[PROF_LOAD], f->incl[PROF_STORE]);
+  }
+  fclose(fp);
+  Log("Profiler: statistics of %d functions are written to %s", nr_func, stat_file);
+}
+
+void prof_dump() {
+  if (!g_prof_enable) return;
+  if (out_file != NULL) sample_dump();
+  if (func_stat) func_stat_dump();
+}
+
+void prof_set_index(int idx) {
+  static char out_buf[256], stat_buf[256];
+  if (out_file != NULL) {
+    snprintf(out_buf, sizeof(out_buf), "%s.%d", out_file, idx);
+    out_file = out_buf;
+  }
+  if (stat_file != NULL) {
+    snprintf(stat_buf, sizeof(stat_buf), "%s.%d", stat_file, idx);
+    stat_file = stat_buf;
+  }
+}
+
+void init_profiler(const char *elf_file, const char *prof_file, const char *func_file) {
+  if (prof_file == NULL && func_file == NULL) return;
+  if (elf_file != NULL) load_symbols(elf_file);
+  else Log("Profiler: no ELF file is given, functions are named by addresses");
+  out_file = prof_file;
+  stat_file = func_file;
+  func_stat = (func_file != NULL);
+  memcpy(last_cnt, g_prof_cnt, sizeof(last_cnt));
+  frame_push(func_of(cpu.pc), 0);
+  g_prof_enable = true;
+  if (prof_file != NULL) {
+    last_inst = g_nr_guest_inst;
+    event_schedule(&prof_event, CONFIG_PROFILER_INTERVAL);
+  }
+}
+#endif
@@ -0,0 +1,78 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/stat.h>
+
+#ifdef CONFIG_INST_STAT
+/* The histogram of instructions is a list of the counters of the INSTPAT
+ * patterns executed, which are only sorted when they are printed. */
+
+uint64_t g_stat_cnt[NR_STAT_CNT] = {};
+uint64_t g_stat_load_width[9] = {}, g_stat_store_width[9] = {};
+
+static InstStat *stat_list = NULL;
+static int nr_stat = 0;
+
+void stat_register(InstStat *s) {
+  s->next = stat_list;
+  stat_list = s;
+  nr_stat ++;
+}
+
+typedef struct {
+  const char *name;
+  uint64_t cnt;
+} StatEntry;
+
+static int stat_cmp(const void *a, const void *b) {
+  uint64_t x = ((StatEntry *)a)->cnt, y = ((StatEntry *)b)->cnt;
+  return (x < y) - (x > y);
+}
+
+static void width_dump(const char *what, uint64_t *cnt) {
+  int len;
+  for (len = 1; len <= 8; len *= 2) {
+    if (cnt[len] != 0) Log("  %s of %d byte%s = %'" PRIu64, what, len, (len == 1 ? "" : "s"), cnt[len]);
+  }
+}
+
+void stat_dump() {
+  StatEntry *e = malloc(sizeof(StatEntry) * (nr_stat + 1));
+  assert(e);
+  uint64_t total = 0;
+  int n = 0, i;
+  InstStat *s;
+  for (s = stat_list; s != NULL; s = s->next) {
+    total += s->cnt;
+    // call sites with the same name, e.g. inv, are merged
+    for (i = 0; i < n && strcmp(e[i].name, s->name) != 0; i ++);
+    if (i == n) e[n ++] = (StatEntry) { .name = s->name };
+    e[i].cnt += s->cnt;
+  }
+  qsort(e, n, sizeof(StatEntry), stat_cmp);
+  Log("instruction mix:");
+  for (i = 0; i < n; i ++) {
+    Log("  %-8s %'16" PRIu64 " %6.2f%%", e[i].name, e[i].cnt, 100.0 * e[i].cnt / total);
+  }
+  free(e);
+
+  uint64_t nr_br = g_stat_cnt[STAT_BRANCH], nr_taken = g_stat_cnt[STAT_TAKEN];
+  Log("branches = %'" PRIu64 ", taken = %'" PRIu64 " (%.2f%%), not taken = %'" PRIu64,
+      nr_br, nr_taken, nr_br == 0 ? 0 : 100.0 * nr_taken / nr_br, nr_br - nr_taken);
+  Log("loads = %'" PRIu64 ", stores = %'" PRIu64, g_stat_cnt[STAT_LOAD], g_stat_cnt[STAT_STORE]);
+  width_dump("loads", g_stat_load_width);
+  width_dump("stores", g_stat_store_width);
+}
+#endif
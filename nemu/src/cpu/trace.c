@@ -0,0 +1,241 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/trace.h>
+
+#if defined(CONFIG_ITRACE) || defined(CONFIG_IQUEUE)
+void itrace_format(char *buf, int size, vaddr_t pc, uint8_t *inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", pc);
+  int i;
+#ifdef CONFIG_ISA_x86
+  for (i = 0; i < ilen; i ++) {
+#else
+  for (i = ilen - 1; i >= 0; i --) {
+#endif
+    p += snprintf(p, 4, " %02x", inst[i]);
+  }
+  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
+  int space_len = ilen_max - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+  disassemble(p, buf + size - p, MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), inst, ilen);
+}
+#endif
+
+#ifdef CONFIG_ITRACE_BINARY
+#include <pthread.h>
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+#include <zlib.h>
+#endif
+
+/* With --itrace=FILE, the instructions traced are written to FILE as
+ * InstRecord instead of lines in the log. Records are appended to one of
+ * two pages, and a full page is handed to a writer thread, so tracing
+ * only waits when the writer is a whole page behind. --itrace-decode=FILE
+ * prints the records as the lines in the log. */
+
+#define PAGE_NR_RECORD (1 << 16)
+
+typedef struct {
+  char magic[8]; // "NEMUITRC"
+  char isa[16];
+  uint32_t version;
+  uint32_t record_size;
+} Header;
+
+InstRecord *g_itrace_ptr = NULL, *g_itrace_end = NULL;
+static InstRecord *page[2] = {};
+static int cur = 0; // the page being filled
+static uint64_t nr_record = 0;
+static const char *out_file = NULL;
+static bool forked = false;
+
+// shared with the writer
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static InstRecord *full = NULL; // the page being written
+static size_t full_nr = 0;
+static bool stop = false;
+static pthread_t writer;
+
+// ----------- output -----------
+
+static FILE *out_fp = NULL;
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+static gzFile out_gz = NULL;
+#endif
+static bool out_ok = true;
+
+static void out(const void *buf, size_t n) {
+  if (n == 0) return;
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+  if (out_gz != NULL) {
+    if (gzwrite(out_gz, buf, n) != (int)n) out_ok = false;
+    return;
+  }
+#endif
+  if (fwrite(buf, n, 1, out_fp) != 1) out_ok = false;
+}
+
+static bool is_gz_file(const char *file) {
+  size_t n = strlen(file);
+  return n > 3 && strcmp(file + n - 3, ".gz") == 0;
+}
+
+static bool out_open(const char *file) {
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+  if (is_gz_file(file)) {
+    // favor speed over ratio
+    out_gz = gzopen(file, "wb1");
+    return out_gz != NULL;
+  }
+#else
+  if (is_gz_file(file)) Log("zlib is not enabled, '%s' is not compressed", file);
+#endif
+  out_fp = fopen(file, "wb");
+  if (out_fp == NULL) return false;
+  // pages are large enough, and nothing is left to flush twice after fork()
+  setvbuf(out_fp, NULL, _IONBF, 0);
+  return true;
+}
+
+static void out_close() {
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+  if (out_gz != NULL && gzclose(out_gz) != Z_OK) out_ok = false;
+  out_gz = NULL;
+#endif
+  if (out_fp != NULL && fclose(out_fp) != 0) out_ok = false;
+  out_fp = NULL;
+}
+
+static void* writer_thread(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (full == NULL && !stop) pthread_cond_wait(&cond, &lock);
+    if (full == NULL) break;
+    InstRecord *p = full;
+    size_t n = full_nr;
+    pthread_mutex_unlock(&lock);
+    out(p, n * sizeof(InstRecord));
+    pthread_mutex_lock(&lock);
+    full = NULL;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// ----------- trace -----------
+
+// hand the first `n` records of the current page to the writer, and fill the other one
+static void hand_off(size_t n) {
+  pthread_mutex_lock(&lock);
+  while (full != NULL) pthread_cond_wait(&cond, &lock);
+  full = page[cur];
+  full_nr = n;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  nr_record += n;
+  cur ^= 1;
+  g_itrace_ptr = page[cur];
+  g_itrace_end = page[cur] + PAGE_NR_RECORD;
+}
+
+void itrace_flip() {
+  if (forked) g_itrace_ptr = page[cur];
+  else hand_off(PAGE_NR_RECORD);
+}
+
+void itrace_close() {
+  if (g_itrace_ptr == NULL || forked) return;
+  hand_off(g_itrace_ptr - page[cur]);
+  g_itrace_ptr = g_itrace_end = NULL;
+  pthread_mutex_lock(&lock);
+  stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  out_close();
+  if (out_ok) Log("%" PRIu64 " instructions are traced to %s", nr_record, out_file);
+  else Log("Failed to write the instruction trace to %s", out_file);
+}
+
+// the writer is not inherited by a child, whose records are dropped
+static void itrace_forked() {
+  forked = true;
+}
+
+void init_itrace(const char *file) {
+  Assert(out_open(file), "Can not open '%s'", file);
+  out_file = file;
+  Header h = { .magic = "NEMUITRC", .version = 1, .record_size = sizeof(InstRecord) };
+  strncpy(h.isa, CONFIG_ISA, sizeof(h.isa) - 1);
+  out(&h, sizeof(h));
+
+  int i;
+  for (i = 0; i < 2; i ++) {
+    page[i] = malloc(sizeof(InstRecord) * PAGE_NR_RECORD);
+    assert(page[i]);
+  }
+  cur = 0;
+  g_itrace_ptr = page[0];
+  g_itrace_end = page[0] + PAGE_NR_RECORD;
+  int ret = pthread_create(&writer, NULL, writer_thread, NULL);
+  Assert(ret == 0, "can not create the trace writer");
+  pthread_atfork(NULL, NULL, itrace_forked);
+  atexit(itrace_close);
+  Log("Instructions are traced to %s", file);
+}
+
+// ----------- decode -----------
+
+void itrace_decode(const char *file) {
+#ifdef CONFIG_ITRACE_BINARY_ZLIB
+  // plain files are read as they are
+  gzFile fp = gzopen(file, "rb");
+#define in(buf, n) gzread(fp, buf, n)
+#else
+  FILE *fp = fopen(file, "rb");
+#define in(buf, n) fread(buf, 1, n, fp)
+#endif
+  Assert(fp, "Can not open '%s'", file);
+  Header h;
+  bool ok = (in(&h, sizeof(h)) == sizeof(h));
+  Assert(ok && memcmp(h.magic, "NEMUITRC", sizeof(h.magic)) == 0,
+      "'%s' is not an instruction trace%s", file,
+      MUXDEF(CONFIG_ITRACE_BINARY_ZLIB, "", ", or it is compressed and zlib is not enabled"));
+  Assert(h.version == 1 && h.record_size == sizeof(InstRecord) && strcmp(h.isa, CONFIG_ISA) == 0,
+      "'%s' is traced by NEMU of %s", file, h.isa);
+
+  InstRecord *buf = malloc(sizeof(InstRecord) * PAGE_NR_RECORD);
+  assert(buf);
+  char line[128];
+  long n, i;
+  while ((n = (long)in(buf, sizeof(InstRecord) * PAGE_NR_RECORD) / (long)sizeof(InstRecord)) > 0) {
+    for (i = 0; i < n; i ++) {
+      itrace_format(line, sizeof(line), buf[i].pc, buf[i].inst, inst_record_len(&buf[i]));
+      puts(line);
+    }
+  }
+#undef in
+  free(buf);
+  MUXDEF(CONFIG_ITRACE_BINARY_ZLIB, gzclose, fclose)(fp);
+}
+#endif
@@ -15,8 +15,6 @@
 
 #include <common.h>
 #include <device/alarm.h>
-#include <sys/time.h>
-#include <signal.h>
 
 #define MAX_HANDLER 8
 
@@ -28,24 +26,11 @@ void add_alarm_handle(alarm_handler_t h) {
   handler[idx ++] = h;
 }
 
-static void alarm_sig_handler(int signum) {
+// called by the device tick at TIMER_HZ, instead of a SIGVTALRM
+// handler which may interrupt the engine at any point
+void alarm_fire() {
   int i;
   for (i = 0; i < idx; i ++) {
     handler[i]();
   }
 }
-
-void init_alarm() {
-  struct sigaction s;
-  memset(&s, 0, sizeof(s));
-  s.sa_handler = alarm_sig_handler;
-  int ret = sigaction(SIGVTALRM, &s, NULL);
-  Assert(ret == 0, "Can not set signal handler");
-
-  struct itimerval it = {};
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
-  it.it_interval = it.it_value;
-  ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
-  Assert(ret == 0, "Can not set timer");
-}
@@ -0,0 +1,63 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/event.h>
+#include <device/clint.h>
+#include <utils.h>
+
+/* The core local interruptor of the SiFive layout. Every hart has a msip
+ * word for software interrupts, and a mtimecmp to raise the timer interrupt
+ * when mtime, which counts in us, reaches it. */
+
+#define CLINT_SIZE   0x10000
+#define MSIP_OFF     0x0
+#define MTIMECMP_OFF 0x4000
+#define MTIME_OFF    0xbff8
+
+#define NR_CLINT_HART MUXDEF(CONFIG_MULTI_HART, CONFIG_NR_HART, 1)
+// the host clock is sampled once per this many queries of a hart
+#define MTIME_SAMPLE 1024
+
+static uint8_t *clint_base = NULL;
+
+#define msip(h)     ((uint32_t *)(clint_base + MSIP_OFF))[h]
+#define mtimecmp(h) ((uint64_t *)(clint_base + MTIMECMP_OFF))[h]
+#define mtime       (*(uint64_t *)(clint_base + MTIME_OFF))
+
+static inline uint64_t clint_time() {
+  return MUXDEF(CONFIG_VIRTUAL_TIME, virtual_time(), get_time());
+}
+
+word_t clint_mip(int hart) {
+  static HART_LOCAL uint64_t now = 0;
+  static HART_LOCAL int nr_query = 0;
+  if (nr_query -- == 0) {
+    now = clint_time();
+    nr_query = MTIME_SAMPLE;
+  }
+  return (msip(hart) & 1 ? (1u << 3) : 0) |   // MSIP
+    (now >= mtimecmp(hart) ? (1u << 7) : 0); // MTIP
+}
+
+static void clint_io_handler(uint32_t offset, int len, bool is_write) {
+  if (!is_write && offset >= MTIME_OFF) mtime = clint_time();
+}
+
+void init_clint() {
+  clint_base = new_space(CLINT_SIZE);
+  memset(clint_base + MTIMECMP_OFF, 0xff, sizeof(uint64_t) * NR_CLINT_HART);
+  add_mmio_map("clint", CONFIG_CLINT_MMIO, clint_base, CLINT_SIZE, clint_io_handler);
+}
@@ -16,6 +16,7 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -23,27 +24,22 @@
 void init_map();
 void init_serial();
 void init_timer();
+void init_clint();
 void init_vga();
 void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
-
+static void device_refresh() {
   IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_TARGET_AM
+  IFNDEF(CONFIG_VIRTUAL_TIME, alarm_fire());
+
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
@@ -66,6 +62,48 @@ void device_update() {
 #endif
 }
 
+/* The device tick refreshes the screen, polls SDL events and runs the alarm
+ * handlers at TIMER_HZ. It is an event scheduled in guest instructions, and
+ * the host clock is only sampled when it fires. The number of instructions
+ * to the next tick is estimated by the simulation speed measured between
+ * two ticks. */
+#define TICK_US (1000000 / TIMER_HZ)
+#define MIN_TICK_INST 1000
+#define MAX_TICK_INST 100000000
+
+static void device_tick(Event *e) {
+  static uint64_t last_refresh = 0, last_us = 0, last_inst = 0;
+  static uint64_t delay = MIN_TICK_INST;
+  uint64_t now = get_time();
+
+  if (now - last_refresh >= TICK_US) {
+    last_refresh = now;
+    device_refresh();
+  }
+
+  // instructions per us since the last tick
+  uint64_t inst = g_nr_guest_inst - last_inst;
+  uint64_t us = now - last_us;
+  delay = (us == 0 ? delay * 2 : inst * (last_refresh + TICK_US - now) / us);
+  if (delay < MIN_TICK_INST) delay = MIN_TICK_INST;
+  if (delay > MAX_TICK_INST) delay = MAX_TICK_INST;
+  last_us = now;
+  last_inst = g_nr_guest_inst;
+  event_schedule(e, delay);
+}
+
+static Event tick_event = { .name = "device tick", .handler = device_tick };
+
+#if defined(CONFIG_VIRTUAL_TIME) && !defined(CONFIG_TARGET_AM)
+// in virtual time, alarm handlers run at TIMER_HZ of the guest
+static void alarm_tick(Event *e) {
+  alarm_fire();
+  event_schedule(e, VIRTUAL_US_TO_INST(TICK_US));
+}
+
+static Event alarm_event = { .name = "alarm", .handler = alarm_tick };
+#endif
+
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
   SDL_Event event;
@@ -76,14 +114,19 @@ void sdl_clear_event_queue() {
 void init_device() {
   IFDEF(CONFIG_TARGET_AM, ioe_init());
   init_map();
+  init_event();
 
   IFDEF(CONFIG_HAS_SERIAL, init_serial());
   IFDEF(CONFIG_HAS_TIMER, init_timer());
+  IFDEF(CONFIG_HAS_CLINT, init_clint());
   IFDEF(CONFIG_HAS_VGA, init_vga());
   IFDEF(CONFIG_HAS_KEYBOARD, init_i8042());
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  event_schedule(&tick_event, 0);
+#if defined(CONFIG_VIRTUAL_TIME) && !defined(CONFIG_TARGET_AM)
+  event_schedule(&alarm_event, VIRTUAL_US_TO_INST(TICK_US));
+#endif
 }
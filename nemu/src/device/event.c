@@ -0,0 +1,98 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+#include <device/event.h>
+
+// pending events sorted by `when`
+static Event *queue = NULL;
+uint64_t g_event_next = UINT64_MAX;
+
+#define MAX_EVENT 16
+
+// every event ever scheduled, and their times saved in snapshots
+static Event *events[MAX_EVENT] = {};
+static uint64_t event_when[MAX_EVENT] = {};
+static int nr_event = 0;
+
+static void event_add(Event *e) {
+  int i;
+  for (i = 0; i < nr_event; i ++) {
+    if (events[i] == e) return;
+  }
+  Assert(nr_event < MAX_EVENT, "too many events");
+  events[nr_event ++] = e;
+}
+
+static bool event_pending(Event *e) {
+  Event *p;
+  for (p = queue; p != NULL; p = p->next) {
+    if (p == e) return true;
+  }
+  return false;
+}
+
+static void event_insert(Event *e) {
+  Event **p = &queue;
+  while (*p != NULL && (*p)->when <= e->when) p = &(*p)->next;
+  e->next = *p;
+  *p = e;
+  g_event_next = queue->when;
+}
+
+static void event_save() {
+  int i;
+  for (i = 0; i < nr_event; i ++) {
+    event_when[i] = (event_pending(events[i]) ? events[i]->when : UINT64_MAX);
+  }
+}
+
+static void event_load() {
+  int i;
+  queue = NULL;
+  g_event_next = UINT64_MAX;
+  for (i = 0; i < nr_event; i ++) {
+    if (event_when[i] == UINT64_MAX) continue;
+    events[i]->when = event_when[i];
+    event_insert(events[i]);
+  }
+}
+
+void init_event() {
+  snapshot_add("events", event_when, sizeof(event_when));
+  snapshot_add_hook(event_save, event_load);
+}
+
+void event_cancel(Event *e) {
+  Event **p;
+  for (p = &queue; *p != NULL; p = &(*p)->next) {
+    if (*p == e) { *p = e->next; break; }
+  }
+  g_event_next = (queue == NULL ? UINT64_MAX : queue->when);
+}
+
+void event_schedule(Event *e, uint64_t delay) {
+  event_cancel(e);
+  event_add(e);
+  e->when = g_nr_guest_inst + delay;
+  event_insert(e);
+}
+
+void event_run() {
+  while (queue != NULL && queue->when <= g_nr_guest_inst) {
+    Event *e = queue;
+    queue = e->next;
+    g_event_next = (queue == NULL ? UINT64_MAX : queue->when);
+    e->handler(e);
+  }
+}
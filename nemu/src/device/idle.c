@@ -0,0 +1,98 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <device/idle.h>
+#include <device/event.h>
+#include <memory/host.h>
+#include <memory/paddr.h>
+
+// longest iteration of an idle loop, in guest instructions
+#define MAX_IDLE_LOOP_INST 1024
+
+/* A loop is anchored at the first polling instruction seen. The registers
+ * must be the same at two consecutive polls there before stores are checked
+ * (ARMED), and the next iteration is watched in full (WATCH). A watched
+ * iteration which neither changes the registers nor stores a new value is
+ * a fixed point until a device event arrives. The guest time then jumps to
+ * that event, as if the guest were preempted, even if the loop would have
+ * exited a little earlier on its own deadline. */
+
+enum { IDLE_NONE, IDLE_ANCHOR, IDLE_ARMED, IDLE_WATCH };
+
+static struct {
+  int state;
+  vaddr_t pc;     // the polling instruction
+  uint64_t inst;  // g_nr_guest_inst at the last poll at `pc`
+  CPU_state regs; // registers at the last poll at `pc`
+  bool dirty;     // a store in the iteration changed the memory
+} loop = { .state = IDLE_NONE };
+
+bool g_idle_watch = false;
+uint64_t g_nr_idle_inst = 0;
+static uint64_t nr_skip = 0;
+
+void idle_reset() {
+  loop.state = IDLE_NONE;
+  g_idle_watch = false;
+}
+
+// leave the loop once it runs longer than an iteration without polling
+bool idle_check() {
+  if (g_nr_guest_inst - loop.inst <= MAX_IDLE_LOOP_INST) return true;
+  idle_reset();
+  return false;
+}
+
+void idle_store(paddr_t addr, int len, word_t data) {
+  if (!idle_check()) return;
+  // other regions are not tracked, and device writes reset the detection
+  if (!in_pmem(addr) || host_read(guest_to_host(addr), len) != data) loop.dirty = true;
+}
+
+static void idle_skip(uint64_t iter) {
+  if (g_event_next == UINT64_MAX || g_event_next <= g_nr_guest_inst) return;
+  // skip whole iterations
+  uint64_t n = (g_event_next - g_nr_guest_inst + iter - 1) / iter * iter;
+  g_nr_guest_inst += n;
+  nr_skip ++;
+  g_nr_idle_inst += n;
+}
+
+void idle_poll() {
+  uint64_t now = g_nr_guest_inst;
+  if (loop.state != IDLE_NONE && now - loop.inst > MAX_IDLE_LOOP_INST) idle_reset();
+  if (loop.state != IDLE_NONE && cpu.pc != loop.pc) return; // another poll in the iteration
+
+  if (loop.state == IDLE_NONE) {
+    loop.state = IDLE_ANCHOR;
+    loop.pc = cpu.pc;
+  } else {
+    bool same = (now > loop.inst && memcmp(&cpu, &loop.regs, sizeof(cpu)) == 0);
+    if (!same) { loop.state = IDLE_ANCHOR; g_idle_watch = false; }
+    else if (loop.state == IDLE_ANCHOR) { loop.state = IDLE_ARMED; g_idle_watch = true; }
+    // the JIT may have run part of the armed iteration without checking stores
+    else if (loop.state == IDLE_ARMED) loop.state = IDLE_WATCH;
+    else if (!loop.dirty) idle_skip(now - loop.inst);
+  }
+
+  memcpy(&loop.regs, &cpu, sizeof(cpu));
+  loop.inst = g_nr_guest_inst;
+  loop.dirty = false;
+}
+
+void idle_statistic() {
+  Log("idle loops skipped = %" PRIu64 ", elided guest instructions = %" PRIu64, nr_skip, g_nr_idle_inst);
+}
@@ -17,6 +17,7 @@
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#include <device/idle.h>
 
 #define IO_SPACE_MAX (32 * 1024 * 1024)
 
@@ -29,17 +30,19 @@ uint8_t* new_space(int size) {
   size = (size + (PAGE_SIZE - 1)) & ~PAGE_MASK;
   p_space += size;
   assert(p_space - io_space < IO_SPACE_MAX);
+  snapshot_add("io space", p, size);
   return p;
 }
 
+// the dispatchers only return a map containing `addr`, so the
+// bound is rechecked only when runtime checking is enabled
 static void check_bound(IOMap *map, paddr_t addr) {
-  if (map == NULL) {
-    Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
-  } else {
-    Assert(addr <= map->high && addr >= map->low,
-        "address (" FMT_PADDR ") is out of bound {%s} [" FMT_PADDR ", " FMT_PADDR "] at pc = " FMT_WORD,
-        addr, map->name, map->low, map->high, cpu.pc);
-  }
+  Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
+#ifdef CONFIG_RT_CHECK
+  Assert(addr <= map->high && addr >= map->low,
+      "address (" FMT_PADDR ") is out of bound {%s} [" FMT_PADDR ", " FMT_PADDR "] at pc = " FMT_WORD,
+      addr, map->name, map->low, map->high, cpu.pc);
+#endif
 }
 
 static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_write) {
@@ -53,8 +56,10 @@ void init_map() {
 }
 
 word_t map_read(paddr_t addr, int len, IOMap *map) {
-  assert(len >= 1 && len <= 8);
+  IFDEF(CONFIG_RT_CHECK, assert(len >= 1 && len <= 8));
   check_bound(map, addr);
+  if (map->skip_ref) { difftest_skip_ref(); }
+  IFDEF(CONFIG_IDLE_SKIP, map->idle_poll ? idle_poll() : idle_reset());
   paddr_t offset = addr - map->low;
   invoke_callback(map->callback, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
@@ -62,8 +67,10 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
 }
 
 void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
-  assert(len >= 1 && len <= 8);
+  IFDEF(CONFIG_RT_CHECK, assert(len >= 1 && len <= 8));
   check_bound(map, addr);
+  if (map->skip_ref) { difftest_skip_ref(); }
+  IFDEF(CONFIG_IDLE_SKIP, idle_reset());
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
   invoke_callback(map->callback, offset, len, true);
@@ -12,45 +12,92 @@
 *
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
-
 #include <device/map.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+/* Device pages are indexed by a two-level table. A page covered by a single
+ * map points to it, and other device pages have a byte-granular index of the
+ * maps inside them, so that dispatching an access costs a few loads. */
+
+typedef struct {
+  IOMap *map;      // the map covering the whole page
+  uint16_t *owner; // owner[offset] is the index of the map at offset in `maps`, 0 for none
+} MMIOPage;
 
-#define NR_MAP 16
+#define DIR_SHIFT 10
+#define NR_DIR (1 << (32 - PAGE_SHIFT - DIR_SHIFT))
 
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static MMIOPage *mmio_dir[NR_DIR] = {};
+
+// maps[0] is reserved as no map
+static IOMap **maps = NULL;
+static int nr_map = 1, max_map = 0;
+
+static MMIOPage* mmio_page(paddr_t addr, bool alloc) {
+#ifdef PMEM64
+  if (addr >= (1ull << 32)) { Assert(!alloc, "MMIO above 4GB is not supported"); return NULL; }
+#endif
+  MMIOPage **dir = &mmio_dir[addr >> (PAGE_SHIFT + DIR_SHIFT)];
+  if (*dir == NULL) {
+    if (!alloc) return NULL;
+    *dir = calloc(1 << DIR_SHIFT, sizeof(MMIOPage));
+    assert(*dir);
+  }
+  return &(*dir)[(addr >> PAGE_SHIFT) & ((1 << DIR_SHIFT) - 1)];
+}
 
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  MMIOPage *p = mmio_page(addr, false);
+  if (p == NULL) return NULL;
+  if (p->map != NULL) return p->map;
+  if (p->owner != NULL) return maps[p->owner[addr & PAGE_MASK]];
+  return NULL;
 }
 
-static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
-    const char *name2, paddr_t l2, paddr_t r2) {
-  panic("MMIO region %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped "
-               "with %s@[" FMT_PADDR ", " FMT_PADDR "]", name1, l1, r1, name2, l2, r2);
+static int new_map() {
+  if (nr_map >= max_map) {
+    max_map = (max_map == 0 ? 16 : max_map * 2);
+    IOMap **new_maps = malloc(sizeof(IOMap *) * max_map);
+    assert(new_maps);
+    new_maps[0] = NULL;
+    if (maps != NULL) {
+      memcpy(new_maps, maps, sizeof(IOMap *) * nr_map);
+      free(maps);
+    }
+    maps = new_maps;
+  }
+  assert(nr_map <= UINT16_MAX);
+  maps[nr_map] = malloc(sizeof(IOMap));
+  assert(maps[nr_map]);
+  return nr_map ++;
 }
 
 /* device interface */
-void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
-  paddr_t left = addr, right = addr + len - 1;
-  if (in_pmem(left) || in_pmem(right)) {
-    report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
-  }
-  for (int i = 0; i < nr_map; i++) {
-    if (left <= maps[i].high && right >= maps[i].low) {
-      report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
+IOMap* add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
+  int id = new_map();
+  IOMap *map = maps[id];
+  *map = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+    .space = space, .callback = callback, .skip_ref = true };
+  // panic if it is overlapped with other regions
+  paddr_add_region(name, addr, len, NULL, map);
+
+  paddr_t page;
+  for (page = addr & ~PAGE_MASK; page <= map->high && page >= (addr & ~PAGE_MASK); page += PAGE_SIZE) {
+    MMIOPage *p = mmio_page(page, true);
+    if (map->low <= page && map->high >= page + PAGE_MASK) { p->map = map; continue; }
+    if (p->owner == NULL) {
+      p->owner = calloc(PAGE_SIZE, sizeof(uint16_t));
+      assert(p->owner);
     }
+    paddr_t lo = (map->low > page ? map->low : page) - page;
+    paddr_t hi = (map->high < page + PAGE_MASK ? map->high : page + PAGE_MASK) - page;
+    paddr_t off;
+    for (off = lo; off <= hi; off ++) { p->owner[off] = id; }
   }
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
-  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
-
-  nr_map ++;
+  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]", map->name, map->low, map->high);
+  return map;
 }
 
 /* bus interface */
@@ -92,9 +92,15 @@ void init_i8042() {
   i8042_data_port_base = (uint32_t *)new_space(4);
   i8042_data_port_base[0] = NEMU_KEY_NONE;
 #ifdef CONFIG_HAS_PORT_IO
-  add_pio_map ("keyboard", CONFIG_I8042_DATA_PORT, i8042_data_port_base, 4, i8042_data_io_handler);
+  IOMap *map = add_pio_map ("keyboard", CONFIG_I8042_DATA_PORT, i8042_data_port_base, 4, i8042_data_io_handler);
 #else
-  add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
+  IOMap *map = add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
+#endif
+  map->idle_poll = true;
+#ifndef CONFIG_TARGET_AM
+  init_keymap();
+  snapshot_add("key queue", key_queue, sizeof(key_queue));
+  snapshot_add("key front", &key_f, sizeof(key_f));
+  snapshot_add("key rear", &key_r, sizeof(key_r));
 #endif
-  IFNDEF(CONFIG_TARGET_AM, init_keymap());
 }
@@ -122,6 +122,11 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   }
 }
 
+// the image is not saved in snapshots, only the position in it
+static void sdcard_reload() {
+  if (fp) fseek(fp, (blk_addr << 9) + addr, SEEK_SET);
+}
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
@@ -131,4 +136,11 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+
+  snapshot_add("sdcard blkcnt", &blkcnt, sizeof(blkcnt));
+  snapshot_add("sdcard blk_addr", &blk_addr, sizeof(blk_addr));
+  snapshot_add("sdcard addr", &addr, sizeof(addr));
+  snapshot_add("sdcard write_cmd", &write_cmd, sizeof(write_cmd));
+  snapshot_add("sdcard read_ext_csd", &read_ext_csd, sizeof(read_ext_csd));
+  snapshot_add_hook(NULL, sdcard_reload);
 }
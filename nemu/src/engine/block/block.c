@@ -0,0 +1,166 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
+#include <device/event.h>
+#include <device/idle.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#ifdef CONFIG_BLOCK_JIT
+#include "jit.h"
+#endif
+
+#define MAX_BLOCK_INST 64
+
+#if (CONFIG_BLOCK_CACHE_SIZE & (CONFIG_BLOCK_CACHE_SIZE - 1)) != 0
+#error CONFIG_BLOCK_CACHE_SIZE must be a power of 2
+#endif
+
+/* A block is a run of instructions starting at `pc` which ends at the first
+ * control transfer or NEMU state change, at a page boundary, or after
+ * MAX_BLOCK_INST instructions. Blocks are formed by executing them, and are
+ * stale once their code page is written (see pmem_code_gen()). */
+typedef struct Block {
+  vaddr_t pc;
+  uint32_t nr_inst; // 0 if the entry is invalid
+  uint32_t gen;     // generation of the code page when the block was formed
+#ifdef CONFIG_BLOCK_JIT
+  uint32_t nr_exec; // times the block is executed before it is translated
+  jit_code_t code;  // NULL if not translated yet
+#endif
+  struct Block *next[2]; // chained successors, checked against cpu.pc before use
+} Block;
+
+static Block block_cache[CONFIG_BLOCK_CACHE_SIZE] = {};
+
+void exec_once(Decode *s, vaddr_t pc);
+
+static inline Block* block_entry(vaddr_t pc) {
+  return &block_cache[(pc >> 2) & (CONFIG_BLOCK_CACHE_SIZE - 1)];
+}
+
+static inline bool same_page(vaddr_t a, vaddr_t b) {
+  return ((a ^ b) >> PAGE_SHIFT) == 0;
+}
+
+// execute a new block at `pc`, and record it in `b` if it is not NULL
+static uint32_t block_form(Block *b, vaddr_t pc, uint64_t n) {
+  Decode s;
+  uint32_t gen = 0;
+  if (b != NULL) {
+    // mark the page first, so that stores to this block while forming it are caught
+    pmem_mark_code(pc);
+    gen = pmem_code_gen(pc);
+  }
+  uint32_t nr = 0;
+  bool end;
+  do {
+    exec_once(&s, cpu.pc);
+    nr ++;
+    // a block also ends before a possible breakpoint, to be checked at the next entry
+    end = (s.dnpc != s.snpc) || (nemu_state.state != NEMU_RUNNING) ||
+      (nr == MAX_BLOCK_INST) || !same_page(s.snpc, pc) ||
+      MUXDEF(CONFIG_BREAKPOINT, bp_maybe(cpu.pc), false);
+  } while (!end && nr < n);
+
+  // a block cut short by `n` is incomplete, and one whose last instruction
+  // crosses the page boundary is not covered by the generation of the page
+  if (b != NULL && end && same_page(s.snpc - 1, pc)) {
+    *b = (Block) { .pc = pc, .nr_inst = nr, .gen = gen };
+  }
+  return nr;
+}
+
+static uint32_t block_run(Block *b, uint64_t n) {
+  Decode s;
+  uint32_t nr = 0;
+  uint32_t limit = (n < b->nr_inst ? n : b->nr_inst);
+  do {
+    exec_once(&s, cpu.pc);
+    nr ++;
+    // a watchpoint may stop in the middle of a block
+  } while (s.dnpc == s.snpc && nr < limit &&
+      MUXDEF(CONFIG_WATCHPOINT, nemu_state.state == NEMU_RUNNING, true));
+  return nr;
+}
+
+#ifdef CONFIG_BLOCK_JIT
+#define JIT_HOT_THRESHOLD 16
+
+static jit_code_t block_translate(Block *b) {
+  jit_code_t code = jit_translate(b->pc, b->nr_inst);
+  if (code == NULL) {
+    // the translation cache is full, start over
+    jit_flush();
+    int i;
+    for (i = 0; i < CONFIG_BLOCK_CACHE_SIZE; i ++) {
+      block_cache[i].code = NULL;
+      block_cache[i].nr_exec = 0;
+    }
+    code = jit_translate(b->pc, b->nr_inst);
+  }
+  return code;
+}
+
+static uint32_t block_run_jit(Block *b, uint64_t n) {
+  if (b->code == NULL && ++ b->nr_exec >= JIT_HOT_THRESHOLD) { b->code = block_translate(b); }
+  // translated code always runs to the end of the block
+  if (b->code != NULL && n >= b->nr_inst && MUXDEF(CONFIG_IDLE_SKIP, !idle_watching(), true) &&
+      MUXDEF(CONFIG_WATCHPOINT, g_wp_nr_reg == 0, true)) return b->code();
+  return block_run(b, n);
+}
+#endif
+
+void block_flush() {
+  memset(block_cache, 0, sizeof(block_cache));
+  IFDEF(CONFIG_BLOCK_JIT, jit_flush());
+}
+
+void block_execute(uint64_t n) {
+  Block *prev = NULL;
+  bool first = true; // resume from a breakpoint
+  while (n > 0) {
+    vaddr_t pc = cpu.pc;
+    if (!first && bp_stop(pc)) break;
+    first = false;
+    Block *b = NULL;
+    if (prev != NULL) {
+      if (prev->next[0] != NULL && prev->next[0]->pc == pc) b = prev->next[0];
+      else if (prev->next[1] != NULL && prev->next[1]->pc == pc) b = prev->next[1];
+    }
+    if (b == NULL && in_pmem(pc)) {
+      b = block_entry(pc);
+      if (prev != NULL) { prev->next[prev->next[0] != NULL] = b; }
+    }
+
+    uint32_t nr;
+    if (b != NULL && b->pc == pc && b->nr_inst != 0 && b->gen == pmem_code_gen(pc)) {
+      nr = MUXDEF(CONFIG_BLOCK_JIT, block_run_jit(b, n), block_run(b, n));
+    } else {
+      nr = block_form(b, pc, n);
+    }
+    n -= nr;
+    g_nr_guest_inst += nr;
+    IFDEF(CONFIG_DIFFTEST, difftest_step_n(pc, cpu.pc, nr));
+
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_DEVICE, device_update());
+    prev = b;
+    // not to chain the handler to the block interrupted
+    IFDEF(CONFIG_HAS_CLINT, if (cpu_check_intr()) prev = NULL);
+  }
+}
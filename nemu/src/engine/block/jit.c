@@ -0,0 +1,331 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* x86-64 code generator for riscv32 blocks.
+ *
+ * Guest registers stay in cpu.gpr, which is addressed through rbx. Loads and
+ * stores to pmem are done inline through r12, and other addresses call
+ * paddr_read()/paddr_write(). Stores to pages holding cached code (r13 points
+ * to the page generations) also go through paddr_write(), so that the code
+ * caches are invalidated, and leave the block since it may be the one written.
+ * Instructions which are not translated call the interpreter. */
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/host.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+#ifndef __x86_64__
+#error The JIT only supports x86-64 hosts
+#endif
+
+#define JIT_CACHE_SIZE (16 * 1024 * 1024)
+#define MAX_HOST_INST_BYTES 160 // upper bound of the code for one guest instruction, 140 for a store
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+static uint8_t *code_buf = NULL, *code_ptr = NULL;
+
+void exec_once(Decode *s, vaddr_t pc);
+
+#define GPR_OFF(r) (offsetof(CPU_state, gpr) + (r) * sizeof(word_t))
+#define PC_OFF offsetof(CPU_state, pc)
+
+static inline void emit1(uint8_t b) { *code_ptr ++ = b; }
+static inline void emit4(uint32_t v) { memcpy(code_ptr, &v, 4); code_ptr += 4; }
+static inline void emit8(uint64_t v) { memcpy(code_ptr, &v, 8); code_ptr += 8; }
+#define emit(...) do { \
+  const uint8_t __b[] = { __VA_ARGS__ }; \
+  memcpy(code_ptr, __b, sizeof(__b)); code_ptr += sizeof(__b); \
+} while (0)
+
+// jumps with a rel32 to patch later by `jmp_here`
+static inline uint8_t* emit_jcc(uint8_t cc) { emit(0x0f, 0x80 | cc); emit4(0); return code_ptr; }
+static inline uint8_t* emit_jmp() { emit1(0xe9); emit4(0); return code_ptr; }
+static inline void jmp_here(uint8_t *next) {
+  uint32_t rel = code_ptr - next;
+  memcpy(next - 4, &rel, 4);
+}
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xc, CC_GE = 0xd };
+
+// reg = R(r)
+static void load_gpr(int reg, int r) {
+  if (r == 0) { emit(0x31, 0xc0 | (reg << 3) | reg); return; } // xor reg, reg
+  emit(0x8b, 0x80 | (reg << 3) | EBX); emit4(GPR_OFF(r));
+}
+
+// R(r) = reg
+static void store_gpr(int reg, int r) {
+  if (r == 0) return;
+  emit(0x89, 0x80 | (reg << 3) | EBX); emit4(GPR_OFF(r));
+}
+
+// mov dword [rbx + off], imm32
+static void store_imm(uint32_t off, uint32_t imm) {
+  emit(0xc7, 0x83); emit4(off); emit4(imm);
+}
+
+static void emit_call(const void *fn) {
+  emit(0x48, 0xb8); emit8((uintptr_t)fn); // movabs rax, fn
+  emit(0xff, 0xd0);                       // call rax
+}
+
+// return `nr` with cpu.pc already set
+static void emit_exit_dyn(uint32_t nr) {
+  emit1(0xb8); emit4(nr);       // mov eax, nr
+  emit(0x41, 0x5d, 0x41, 0x5c); // pop r13; pop r12
+  emit(0x5b, 0xc3);             // pop rbx; ret
+}
+
+static void emit_exit(vaddr_t pc, uint32_t nr) {
+  store_imm(PC_OFF, pc);
+  emit_exit_dyn(nr);
+}
+
+// ecx = eax - CONFIG_MBASE, and jump to the returned slow path if it is out of pmem
+static uint8_t* emit_pmem_check(int len) {
+  emit(0x8d, 0x88); emit4(-(uint32_t)CONFIG_MBASE); // lea ecx, [rax - CONFIG_MBASE]
+  emit(0x81, 0xf9); emit4(CONFIG_MSIZE - len);       // cmp ecx, CONFIG_MSIZE - len
+  return emit_jcc(CC_A);
+}
+
+static void emit_load(vaddr_t pc, int rd, int rs1, word_t imm, int len, bool sign) {
+  load_gpr(EAX, rs1);
+  emit1(0x05); emit4(imm); // add eax, imm
+  uint8_t *slow = emit_pmem_check(len);
+  // fast path: load from [r12 + rcx]
+  switch (len) {
+    case 1: emit(0x41, 0x0f, sign ? 0xbe : 0xb6, 0x04, 0x0c); break;
+    case 2: emit(0x41, 0x0f, sign ? 0xbf : 0xb7, 0x04, 0x0c); break;
+    case 4: emit(0x41, 0x8b, 0x04, 0x0c); break;
+  }
+  uint8_t *done = emit_jmp();
+  jmp_here(slow);
+  store_imm(PC_OFF, pc);              // for error messages and devices
+  emit(0x89, 0xc7);                   // mov edi, eax
+  emit1(0xbe); emit4(len);            // mov esi, len
+  emit_call(paddr_read);
+  if (sign && len == 1) emit(0x0f, 0xbe, 0xc0); // movsx eax, al
+  if (sign && len == 2) emit(0x0f, 0xbf, 0xc0); // movsx eax, ax
+  jmp_here(done);
+  store_gpr(EAX, rd);
+}
+
+// return true if the store may have modified cached code, or hit a watchpoint
+static int jit_store_slow(paddr_t addr, int len, word_t data) {
+  paddr_t last = addr + len - 1;
+  bool code = (in_pmem(addr) && pmem_code_gen(addr) != 0) || (in_pmem(last) && pmem_code_gen(last) != 0);
+  paddr_write(addr, len, data);
+  return code || MUXDEF(CONFIG_WATCHPOINT, nemu_state.state != NEMU_RUNNING, false);
+}
+
+static void emit_store(vaddr_t pc, int rs1, int rs2, word_t imm, int len, uint32_t nr) {
+  load_gpr(EAX, rs1);
+  emit1(0x05); emit4(imm); // add eax, imm
+  load_gpr(EDX, rs2);
+  // with DiffTest, all stores go through paddr_write() to track the pages written
+#ifndef CONFIG_DIFFTEST
+  uint8_t *slow = emit_pmem_check(len);
+  // a store crossing a page boundary may write code on the second page
+  uint8_t *cross = NULL;
+  if (len > 1) {
+    emit(0x89, 0xce);                             // mov esi, ecx
+    emit(0x81, 0xe6); emit4(PAGE_MASK);           // and esi, PAGE_MASK
+    emit(0x81, 0xfe); emit4(PAGE_SIZE - len);     // cmp esi, PAGE_SIZE - len
+    cross = emit_jcc(CC_A);
+  }
+  emit(0x89, 0xce, 0xc1, 0xee, PAGE_SHIFT);       // mov esi, ecx; shr esi, PAGE_SHIFT
+  emit(0x41, 0x83, 0x7c, 0xb5, 0x00, 0x00);       // cmp dword [r13 + rsi * 4], 0
+  uint8_t *code = emit_jcc(CC_NE);
+  // fast path: store to [r12 + rcx]
+  switch (len) {
+    case 1: emit(0x41, 0x88, 0x14, 0x0c); break;
+    case 2: emit(0x66, 0x41, 0x89, 0x14, 0x0c); break;
+    case 4: emit(0x41, 0x89, 0x14, 0x0c); break;
+  }
+  uint8_t *done = emit_jmp();
+  jmp_here(slow);
+  if (cross != NULL) jmp_here(cross);
+  jmp_here(code);
+#endif
+  store_imm(PC_OFF, pc);
+  emit(0x89, 0xc7);                   // mov edi, eax
+  emit1(0xbe); emit4(len);            // mov esi, len
+  emit_call(jit_store_slow);
+  emit(0x85, 0xc0);                   // test eax, eax
+  uint8_t *cont = emit_jcc(CC_E);
+  emit_exit(pc + 4, nr);
+  jmp_here(cont);
+  IFNDEF(CONFIG_DIFFTEST, jmp_here(done));
+}
+
+// return true if the block should be left after the instruction
+static int jit_interp(vaddr_t pc) {
+  Decode s;
+  exec_once(&s, pc);
+  return (s.dnpc != s.snpc) || (nemu_state.state != NEMU_RUNNING);
+}
+
+static void emit_interp(vaddr_t pc, uint32_t nr) {
+  emit1(0xbf); emit4(pc); // mov edi, pc
+  emit_call(jit_interp);
+  emit(0x85, 0xc0);       // test eax, eax
+  uint8_t *cont = emit_jcc(CC_E);
+  emit_exit_dyn(nr);
+  jmp_here(cont);
+}
+
+// translate one instruction, `nr` is the number of instructions executed including it
+static void translate(vaddr_t pc, uint32_t i, uint32_t nr) {
+  int opcode = BITS(i, 6, 0), f3 = BITS(i, 14, 12), f7 = BITS(i, 31, 25);
+  int rd = BITS(i, 11, 7), rs1 = BITS(i, 19, 15), rs2 = BITS(i, 24, 20);
+  word_t immI = SEXT(BITS(i, 31, 20), 12);
+  word_t immU = SEXT(BITS(i, 31, 12), 20) << 12;
+  word_t immS = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7);
+  word_t immB = SEXT(BITS(i, 31, 31), 1) << 12 | BITS(i, 7, 7) << 11 |
+    BITS(i, 30, 25) << 5 | BITS(i, 11, 8) << 1;
+  word_t immJ = SEXT(BITS(i, 31, 31), 1) << 20 | BITS(i, 19, 12) << 12 |
+    BITS(i, 20, 20) << 11 | BITS(i, 30, 21) << 1;
+
+  switch (opcode) {
+    case 0x37: if (rd != 0) store_imm(GPR_OFF(rd), immU); return;      // lui
+    case 0x17: if (rd != 0) store_imm(GPR_OFF(rd), pc + immU); return; // auipc
+    case 0x6f:                                                         // jal
+      if (rd != 0) store_imm(GPR_OFF(rd), pc + 4);
+      emit_exit(pc + immJ, nr);
+      return;
+    case 0x67:                                                         // jalr
+      if (f3 != 0) break;
+      load_gpr(EAX, rs1);
+      emit1(0x05); emit4(immI);                  // add eax, imm
+      emit(0x25); emit4(~1u);                    // and eax, ~1
+      emit(0x89, 0x83); emit4(PC_OFF);           // mov [cpu.pc], eax
+      if (rd != 0) store_imm(GPR_OFF(rd), pc + 4);
+      emit_exit_dyn(nr);
+      return;
+    case 0x63: {                                                       // branches
+      static const int8_t cc[8] = { CC_E, CC_NE, -1, -1, CC_L, CC_GE, CC_B, CC_AE };
+      if (cc[f3] < 0) break;
+      load_gpr(EAX, rs1);
+      load_gpr(ECX, rs2);
+      emit(0x39, 0xc8);                          // cmp eax, ecx
+      uint8_t *not_taken = emit_jcc(cc[f3] ^ 1);
+      emit_exit(pc + immB, nr);
+      jmp_here(not_taken);
+      return;
+    }
+    case 0x03:                                                         // loads
+      switch (f3) {
+        case 0: emit_load(pc, rd, rs1, immI, 1, true); return;
+        case 1: emit_load(pc, rd, rs1, immI, 2, true); return;
+        case 2: emit_load(pc, rd, rs1, immI, 4, false); return;
+        case 4: emit_load(pc, rd, rs1, immI, 1, false); return;
+        case 5: emit_load(pc, rd, rs1, immI, 2, false); return;
+      }
+      break;
+    case 0x23:                                                         // stores
+      if (f3 > 2) break;
+      emit_store(pc, rs1, rs2, immS, 1 << f3, nr);
+      return;
+    case 0x13:                                                         // ALU with immediate
+      if ((f3 == 1 && f7 != 0) || (f3 == 5 && f7 != 0 && f7 != 0x20)) break;
+      if (rd == 0) return;
+      load_gpr(EAX, rs1);
+      switch (f3) {
+        case 0: emit1(0x05); emit4(immI); break;                       // add eax, imm
+        case 2: emit1(0x3d); emit4(immI); emit(0x0f, 0x9c, 0xc0, 0x0f, 0xb6, 0xc0); break; // setl
+        case 3: emit1(0x3d); emit4(immI); emit(0x0f, 0x92, 0xc0, 0x0f, 0xb6, 0xc0); break; // setb
+        case 4: emit1(0x35); emit4(immI); break;                       // xor eax, imm
+        case 6: emit1(0x0d); emit4(immI); break;                       // or eax, imm
+        case 7: emit1(0x25); emit4(immI); break;                       // and eax, imm
+        case 1: emit(0xc1, 0xe0, rs2); break;                          // shl eax, shamt
+        case 5: emit(0xc1, f7 ? 0xf8 : 0xe8, rs2); break;              // sar/shr eax, shamt
+      }
+      store_gpr(EAX, rd);
+      return;
+    case 0x33:                                                         // ALU with registers
+      if (f7 == 0x01 && f3 >= 4) break; // div and rem are left to the interpreter
+      if (f7 != 0 && f7 != 0x01 && !(f7 == 0x20 && (f3 == 0 || f3 == 5))) break;
+      if (rd == 0) return;
+      load_gpr(EAX, rs1);
+      load_gpr(ECX, rs2);
+      if (f7 == 0x01) {
+        switch (f3) {
+          case 0: emit(0x0f, 0xaf, 0xc1); break;                       // imul eax, ecx
+          case 1: emit(0x48, 0x63, 0xc0, 0x48, 0x63, 0xc9); goto mulh; // movsxd rax, eax; movsxd rcx, ecx
+          case 2: emit(0x48, 0x63, 0xc0); goto mulh;                   // movsxd rax, eax
+          case 3: mulh: emit(0x48, 0x0f, 0xaf, 0xc1, 0x48, 0xc1, 0xe8, 0x20); break; // imul rax, rcx; shr rax, 32
+        }
+      } else {
+        switch (f3) {
+          case 0: emit(f7 ? 0x29 : 0x01, 0xc8); break;                 // sub/add eax, ecx
+          case 1: emit(0xd3, 0xe0); break;                             // shl eax, cl
+          case 2: emit(0x39, 0xc8, 0x0f, 0x9c, 0xc0, 0x0f, 0xb6, 0xc0); break; // setl
+          case 3: emit(0x39, 0xc8, 0x0f, 0x92, 0xc0, 0x0f, 0xb6, 0xc0); break; // setb
+          case 4: emit(0x31, 0xc8); break;                             // xor eax, ecx
+          case 5: emit(0xd3, f7 ? 0xf8 : 0xe8); break;                 // sar/shr eax, cl
+          case 6: emit(0x09, 0xc8); break;                             // or eax, ecx
+          case 7: emit(0x21, 0xc8); break;                             // and eax, ecx
+        }
+      }
+      store_gpr(EAX, rd);
+      return;
+  }
+  emit_interp(pc, nr);
+}
+
+static void init_jit();
+
+jit_code_t jit_translate(vaddr_t pc, uint32_t nr_inst) {
+  if (code_buf == NULL) init_jit();
+  Assert(in_pmem(pc), "can not translate code outside pmem at pc = " FMT_WORD, pc);
+  if (code_buf + JIT_CACHE_SIZE - code_ptr < (nr_inst + 1) * MAX_HOST_INST_BYTES) return NULL;
+
+  jit_code_t code = (jit_code_t)code_ptr;
+  emit(0x53, 0x41, 0x54, 0x41, 0x55);                   // push rbx; push r12; push r13
+  emit(0x48, 0xbb); emit8((uintptr_t)&cpu);             // movabs rbx, &cpu
+  emit(0x49, 0xbc); emit8((uintptr_t)guest_to_host(CONFIG_MBASE)); // movabs r12, pmem
+  emit(0x49, 0xbd); emit8((uintptr_t)pmem_code_gen_table()); // movabs r13, code page generations
+
+  uint32_t k;
+  for (k = 0; k < nr_inst; k ++) {
+    vaddr_t this_pc = pc + k * 4;
+    uint8_t *start = code_ptr;
+    translate(this_pc, host_read(guest_to_host(this_pc), 4), k + 1);
+    Assert(code_ptr - start <= MAX_HOST_INST_BYTES, "%d bytes of host code are emitted for pc = " FMT_WORD
+        ", more than MAX_HOST_INST_BYTES", (int)(code_ptr - start), this_pc);
+  }
+  // the block either falls through or its last instruction has left already
+  emit_exit(pc + nr_inst * 4, nr_inst);
+  return code;
+}
+
+void jit_flush() {
+  code_ptr = code_buf;
+}
+
+static void init_jit() {
+  code_buf = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code_buf != MAP_FAILED, "can not allocate the translation cache");
+  code_ptr = code_buf;
+  Log("JIT: translation cache of %d MB at %p", JIT_CACHE_SIZE >> 20, code_buf);
+}
@@ -0,0 +1,29 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <common.h>
+
+// translated code returns the number of guest instructions executed, and leaves cpu.pc at the next one
+typedef uint32_t (*jit_code_t)();
+
+// translate the block of `nr_inst` instructions at `pc`, return NULL if the translation cache is full
+jit_code_t jit_translate(vaddr_t pc, uint32_t nr_inst);
+// drop all translated code
+void jit_flush();
+
+#endif
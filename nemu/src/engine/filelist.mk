@@ -15,3 +15,10 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+# the block engine shares the entry and the host calls with the interpreter
+DIRS-$(CONFIG_ENGINE_BLOCK) += src/engine/interpreter
+
+ifndef CONFIG_BLOCK_JIT
+SRCS-BLACKLIST-y += src/engine/block/jit.c
+endif
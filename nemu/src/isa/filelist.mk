@@ -15,3 +15,23 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+GEN_DECODE = $(NEMU_HOME)/tools/gen-decode/build/gen-decode
+$(GEN_DECODE):
+	$(MAKE) -s -C $(NEMU_HOME)/tools/gen-decode
+
+ifdef CONFIG_DECODE_TREE
+DECODE_TREE_H = $(NEMU_HOME)/build/gen-$(GUEST_ISA)/decode-tree.h
+INC_PATH += $(dir $(DECODE_TREE_H))
+GEN_HEADERS += $(DECODE_TREE_H)
+$(DECODE_TREE_H): src/isa/$(GUEST_ISA)/inst.c $(GEN_DECODE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(GEN_DECODE) -o $@ $<
+endif
+
+# Report the worst-case number of comparisons to decode an instruction of each ISA
+decode-report: $(GEN_DECODE)
+	@$(GEN_DECODE) $(sort $(wildcard src/isa/*/inst.c))
+
+.PHONY: decode-report
@@ -34,7 +34,6 @@ bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
     printf("Reference PC: %08x, DUT PC: %08x\n", ref_r->pc, cpu.pc);
     return false;
   }
-  printf("diff_true\n");
   return true;  // 所有寄存器都匹配
 }
 
@@ -26,6 +26,13 @@ typedef struct {
   word_t mtvec;
   word_t mepc;
   word_t mcause;
+  word_t mie;
+  word_t mscratch;
+  word_t mhartid;
+  // the reservation of lr.w
+  bool lr_valid;
+  paddr_t lr_addr;
+  word_t lr_val;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -17,9 +17,17 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <cpu/difftest.h>
+#include <cpu/profile.h>
+#include <cpu/stat.h>
+#include <device/clint.h>
+#include <device/event.h>
+#include <memory/paddr.h>
 #include <isa.h>
 
 #define R(i) gpr(i)
+// ra and t0 hold the return addresses of calls by the convention
+#define IS_LINK(r) ((r) == 1 || (r) == 5)
 #define Mr vaddr_read
 #define Mw vaddr_write
 
@@ -28,25 +36,136 @@
 #define CSR_MTVEC   0x305
 #define CSR_MEPC    0x341
 #define CSR_MCAUSE  0x342
+#define CSR_MIE     0x304
+#define CSR_MSCRATCH 0x340
+#define CSR_MIP     0x344
+#define CSR_MHARTID 0xf14
+// the number of harts, a custom read-only CSR for AM
+#define CSR_MNHART  0xfc0
+
+/* mcycle (0), minstret (2) and mhpmcounter3-31 are at 0xb00, their high
+ * halves at 0xb80, and the read-only copies for U-mode at 0xc00 and 0xc80.
+ * Every instruction takes one cycle, and the block engine only adds up the
+ * instructions at the end of a block. With INST_STAT, mhpmcounter3-6 count
+ * loads, stores, branches and taken branches. Writes are ignored. REF counts
+ * differently, so it skips the instructions reading a counter. */
+static inline bool is_counter(word_t csr) {
+  return (csr & 0xf60) == 0xb00 || (csr & 0xf60) == 0xc00;
+}
+
+static inline word_t counter_read(word_t csr) {
+  uint64_t val = 0;
+  int idx = csr & 0x1f;
+  difftest_skip_ref();
+  switch (idx) {
+    case 0: case 2: val = g_nr_guest_inst; break;
+#ifdef CONFIG_INST_STAT
+    case 3 ... 3 + NR_STAT_CNT - 1: val = g_stat_cnt[idx - 3]; break;
+#endif
+    default: break;
+  }
+  return MUXDEF(CONFIG_RV64, val, (csr & 0x80) ? val >> 32 : (uint32_t)val);
+}
 
 static inline word_t csr_read(word_t csr) {
-  switch (csr) {
+  switch (csr & 0xfff) { // the number is sign-extended as an immediate
     case CSR_MSTATUS: return cpu.mstatus;
     case CSR_MTVEC:   return cpu.mtvec;
     case CSR_MEPC:    return cpu.mepc;
     case CSR_MCAUSE:  return cpu.mcause;
-    default: return 0;
+    case CSR_MIE:     return cpu.mie;
+    case CSR_MSCRATCH: return cpu.mscratch;
+    case CSR_MIP:     return MUXDEF(CONFIG_HAS_CLINT, clint_mip(cpu.mhartid), 0);
+    case CSR_MHARTID: return cpu.mhartid;
+    case CSR_MNHART:  difftest_skip_ref(); return MUXDEF(CONFIG_MULTI_HART, CONFIG_NR_HART, 1);
+    default: return is_counter(csr & 0xfff) ? counter_read(csr & 0xfff) : 0;
   }
 }
 
 static inline void csr_write(word_t csr, word_t val) {
-  switch (csr) {
+  switch (csr & 0xfff) {
     case CSR_MSTATUS: cpu.mstatus = val; break;
     case CSR_MTVEC:   cpu.mtvec = val;   break;
     case CSR_MEPC:    cpu.mepc = val;    break;
     case CSR_MCAUSE:  cpu.mcause = val;  break;
-    default: break; // ignore unsupported CSR
+    case CSR_MIE:     cpu.mie = val & (MIP_MSIP | MIP_MTIP); break;
+    case CSR_MSCRATCH: cpu.mscratch = val; break;
+    default: break; // ignore unsupported CSR, and mip, mhartid and mnhart are read-only
+  }
+}
+
+// restore MIE from MPIE
+static inline vaddr_t mret() {
+  cpu.mstatus = (cpu.mstatus & ~MSTATUS_MIE) | ((cpu.mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+  return cpu.mepc;
+}
+
+/* The A extension. lr.w keeps the address and the value loaded, and sc.w
+ * only succeeds if the word still holds the value. When harts run on host
+ * threads at the same time, sc.w and the AMOs on pmem are host atomics. */
+
+enum { AMO_SWAP, AMO_ADD, AMO_XOR, AMO_AND, AMO_OR, AMO_MIN, AMO_MAX, AMO_MINU, AMO_MAXU };
+
+static inline word_t amo_op(int op, word_t a, word_t b) {
+  switch (op) {
+    case AMO_SWAP: return b;
+    case AMO_ADD:  return a + b;
+    case AMO_XOR:  return a ^ b;
+    case AMO_AND:  return a & b;
+    case AMO_OR:   return a | b;
+    case AMO_MIN:  return (sword_t)a < (sword_t)b ? a : b;
+    case AMO_MAX:  return (sword_t)a > (sword_t)b ? a : b;
+    case AMO_MINU: return a < b ? a : b;
+    case AMO_MAXU: return a > b ? a : b;
+    default: panic("bad amo op %d", op);
+  }
+}
+
+#ifdef CONFIG_MULTI_HART
+// the host word for atomics, NULL if the harts do not run at the same time
+static inline word_t* amo_host(vaddr_t addr) {
+  return (g_hart_threaded && in_pmem(addr) && (addr & 3) == 0 ? (word_t *)guest_to_host(addr) : NULL);
+}
+#endif
+
+// return the old value of the word
+static word_t amo(vaddr_t addr, int op, word_t src) {
+#ifdef CONFIG_MULTI_HART
+  word_t *p = amo_host(addr);
+  if (p != NULL) {
+    word_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(p, &old, amo_op(op, old, src), true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old;
+  }
+#endif
+  word_t old = Mr(addr, 4);
+  Mw(addr, 4, amo_op(op, old, src));
+  return old;
+}
+
+static word_t amo_lr(vaddr_t addr) {
+  word_t val = Mr(addr, 4);
+  cpu.lr_valid = true;
+  cpu.lr_addr = addr;
+  cpu.lr_val = val;
+  return val;
+}
+
+// return 0 on success
+static word_t amo_sc(vaddr_t addr, word_t src) {
+  bool valid = cpu.lr_valid && cpu.lr_addr == addr;
+  cpu.lr_valid = false;
+  if (!valid) return 1;
+#ifdef CONFIG_MULTI_HART
+  word_t *p = amo_host(addr);
+  if (p != NULL) {
+    word_t expected = cpu.lr_val;
+    return !__atomic_compare_exchange_n(p, &expected, src, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
   }
+#endif
+  if (Mr(addr, 4) != cpu.lr_val) return 1;
+  Mw(addr, 4, src);
+  return 0;
 }
 
 enum {
@@ -82,15 +201,77 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   }
 }
 
+#ifdef CONFIG_DECODE_CACHE
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  uint8_t rd, rs1, rs2;
+  const void *exec; // the execute body of the matched INSTPAT, NULL if invalid
+  word_t imm;
+} DecodeCacheEntry;
+
+#if (CONFIG_DECODE_CACHE_SIZE & (CONFIG_DECODE_CACHE_SIZE - 1)) != 0
+#error CONFIG_DECODE_CACHE_SIZE must be a power of 2
+#endif
+
+static DecodeCacheEntry decode_cache[CONFIG_DECODE_CACHE_SIZE] = {};
+
+static inline DecodeCacheEntry* decode_cache_entry(vaddr_t pc) {
+  return &decode_cache[(pc >> 2) & (CONFIG_DECODE_CACHE_SIZE - 1)];
+}
+
+// the cache is indexed by vaddr, which is the same as paddr since there is no MMU
+static void decode_cache_fill(Decode *s, const void *exec, int type, int rd, word_t imm) {
+  if (!in_pmem(s->pc)) return;
+  uint32_t i = s->isa.inst;
+  bool has_rs1 = (type == TYPE_I || type == TYPE_S || type == TYPE_R || type == TYPE_B);
+  bool has_rs2 = (type == TYPE_S || type == TYPE_R || type == TYPE_B);
+  DecodeCacheEntry *e = decode_cache_entry(s->pc);
+  *e = (DecodeCacheEntry) { .pc = s->pc, .inst = i, .rd = rd,
+    .rs1 = has_rs1 ? BITS(i, 19, 15) : 0, .rs2 = has_rs2 ? BITS(i, 24, 20) : 0,
+    .exec = exec, .imm = imm };
+  pmem_mark_code(s->pc);
+}
+
+void decode_cache_invalidate(paddr_t addr, int len) {
+  paddr_t a;
+  for (a = addr & ~(paddr_t)3; a < addr + len; a += 4) {
+    DecodeCacheEntry *e = decode_cache_entry(a);
+    if (e->pc == a) { e->exec = NULL; }
+  }
+}
+#endif
+
 static int decode_exec(Decode *s) {
+  int rd = 0;
+  word_t src1 = 0, src2 = 0, imm = 0;
+
+#ifdef CONFIG_DECODE_CACHE
+  DecodeCacheEntry *e = decode_cache_entry(s->pc);
+  if (likely(e->pc == s->pc && e->exec != NULL)) {
+    s->isa.inst = e->inst;
+    s->snpc += 4;
+    s->dnpc = s->snpc;
+    rd = e->rd;
+    src1 = R(e->rs1);
+    src2 = R(e->rs2);
+    imm = e->imm;
+    goto *(e->exec);
+  }
+#endif
+
+  s->isa.inst = inst_fetch(&s->snpc, 4);
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  int rd = 0; \
-  word_t src1 = 0, src2 = 0, imm = 0; \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  IFDEF(CONFIG_DECODE_CACHE, \
+    decode_cache_fill(s, &&concat(__instpat_exec_, __LINE__), concat(TYPE_, type), rd, imm); \
+    concat(__instpat_exec_, __LINE__): ;) \
+  stat_inst(name); \
   __VA_ARGS__ ; \
+  IFDEF(CONFIG_INST_STAT, if (concat(TYPE_, type) == TYPE_B) stat_branch(s->dnpc != s->snpc)); \
 }
 
   INSTPAT_START();
@@ -163,10 +344,12 @@ static int decode_exec(Decode *s) {
   });
 
   // mret: return from trap
-  INSTPAT("0011000 00010 00000 000 00000 11100 11", mret  , N, s->dnpc = cpu.mepc);
+  INSTPAT("0011000 00010 00000 000 00000 11100 11", mret  , N, s->dnpc = mret());
 
-  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4;s->dnpc = s->pc + imm);
-  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4;s->dnpc = (src1 + imm) & ~1);
+  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, R(rd) = s->pc + 4;s->dnpc = s->pc + imm;
+      prof_jump(IS_LINK(rd), false, s->pc, s->dnpc));
+  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, R(rd) = s->pc + 4;s->dnpc = (src1 + imm) & ~1;
+      prof_jump(IS_LINK(rd), rd == 0 && IS_LINK(BITS(s->isa.inst, 19, 15)), s->pc, s->dnpc));
 
   // 添加内存加载指令
   INSTPAT("??????? ????? ????? 000 ????? 00000 11", lb, I,
@@ -212,6 +395,22 @@ static int decode_exec(Decode *s) {
   INSTPAT("0000001 ????? ????? 010 ????? 01100 11", mulhsu , R, R(rd) = ((int64_t)(sword_t)src1 * (uint64_t)src2) >> 32);
   INSTPAT("0000001 ????? ????? 011 ????? 01100 11", mulhu  , R, R(rd) = ((uint64_t)src1 * (uint64_t)src2) >> 32);
 
+  // memory accesses are in order, so the fences and the aq and rl bits are ignored
+  INSTPAT("??????? ????? ????? 000 ????? 00011 11", fence  , N, );
+  INSTPAT("??????? ????? ????? 001 ????? 00011 11", fence_i, N, );
+
+  // A extension
+  INSTPAT("00010?? 00000 ????? 010 ????? 01011 11", lr_w   , R, R(rd) = amo_lr(src1));
+  INSTPAT("00011?? ????? ????? 010 ????? 01011 11", sc_w   , R, R(rd) = amo_sc(src1, src2));
+  INSTPAT("00001?? ????? ????? 010 ????? 01011 11", amoswap, R, R(rd) = amo(src1, AMO_SWAP, src2));
+  INSTPAT("00000?? ????? ????? 010 ????? 01011 11", amoadd , R, R(rd) = amo(src1, AMO_ADD, src2));
+  INSTPAT("00100?? ????? ????? 010 ????? 01011 11", amoxor , R, R(rd) = amo(src1, AMO_XOR, src2));
+  INSTPAT("01100?? ????? ????? 010 ????? 01011 11", amoand , R, R(rd) = amo(src1, AMO_AND, src2));
+  INSTPAT("01000?? ????? ????? 010 ????? 01011 11", amoor  , R, R(rd) = amo(src1, AMO_OR, src2));
+  INSTPAT("10000?? ????? ????? 010 ????? 01011 11", amomin , R, R(rd) = amo(src1, AMO_MIN, src2));
+  INSTPAT("10100?? ????? ????? 010 ????? 01011 11", amomax , R, R(rd) = amo(src1, AMO_MAX, src2));
+  INSTPAT("11000?? ????? ????? 010 ????? 01011 11", amominu, R, R(rd) = amo(src1, AMO_MINU, src2));
+  INSTPAT("11100?? ????? ????? 010 ????? 01011 11", amomaxu, R, R(rd) = amo(src1, AMO_MAXU, src2));
 
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
   INSTPAT_END();
@@ -222,6 +421,5 @@ static int decode_exec(Decode *s) {
 }
 
 int isa_exec_once(Decode *s) {
-  s->isa.inst = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
@@ -30,6 +30,19 @@ void isa_reg_display() {
   printf("pc = 0x%08x\n", cpu.pc);
 }
 
+// `s` is a register name in `regs` without the leading '$', "zero" or "pc"
+const word_t* isa_reg_str2ptr(const char *s) {
+  if (strcmp(s, "pc") == 0) return &cpu.pc;
+  if (strcmp(s, "zero") == 0) return &gpr(0);
+  int i;
+  for (i = 0; i < ARRLEN(regs); i ++) {
+    if (strcmp(s, regs[i] + (regs[i][0] == '$')) == 0) return &gpr(i);
+  }
+  return NULL;
+}
+
 word_t isa_reg_str2val(const char *s, bool *success) {
-  return 0;
+  const word_t *p = isa_reg_str2ptr(s);
+  *success = (p != NULL);
+  return (p != NULL ? *p : 0);
 }
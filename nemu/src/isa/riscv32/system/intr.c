@@ -16,16 +16,28 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/vaddr.h>
+#include <device/clint.h>
+#include "../local-include/reg.h"
 
 // Simple RISC-V trap handling: save epc/mcause, jump to mtvec
 word_t isa_raise_intr(word_t NO, vaddr_t epc) {
   // Save trap cause and epc
   cpu.mcause = NO;
   cpu.mepc = epc;
+  // disable interrupts, and enter M-mode, which is the only mode
+  word_t mpie = (cpu.mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0;
+  cpu.mstatus = (cpu.mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE)) | mpie | MSTATUS_MPP;
+  cpu.lr_valid = false;
   // dnpc should jump to mtvec (direct mode assumed)
   return cpu.mtvec;
 }
 
 word_t isa_query_intr() {
+#ifdef CONFIG_HAS_CLINT
+  if (!(cpu.mstatus & MSTATUS_MIE) || cpu.mie == 0) return INTR_EMPTY;
+  word_t pending = clint_mip(cpu.mhartid) & cpu.mie;
+  if (pending & MIP_MSIP) return (1u << 31) | 3;
+  if (pending & MIP_MTIP) return (1u << 31) | 7;
+#endif
   return INTR_EMPTY;
 }
@@ -13,12 +13,18 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE // memfd_create()
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/map.h>
 #include <device/mmio.h>
+#include <device/idle.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
 #include <isa.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MEMFD)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
@@ -32,8 +38,74 @@ static word_t pmem_read(paddr_t addr, int len) {
   return ret;
 }
 
+#ifdef CONFIG_PMEM_CODE_TRACK
+static uint32_t code_page_gen[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+#define code_page_gen_of(addr) code_page_gen[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+static void page_table_protect(paddr_t addr);
+
+void pmem_mark_code(paddr_t addr) {
+  uint32_t *gen = &code_page_gen_of(addr);
+  if (*gen == 0) {
+    *gen = 1;
+    page_table_protect(addr);
+  }
+}
+
+uint32_t pmem_code_gen(paddr_t addr) {
+  return code_page_gen_of(addr);
+}
+
+const uint32_t* pmem_code_gen_table() {
+  return code_page_gen;
+}
+
+static inline void code_page_bump(paddr_t addr) {
+  uint32_t *gen = &code_page_gen_of(addr);
+  if (*gen != 0 && ++ *gen == 0) *gen = 1;
+}
+
+// a store crossing a page boundary may write code on either page
+static void code_page_write(paddr_t addr, int len) {
+  paddr_t last = addr + len - 1;
+  code_page_bump(addr);
+  if ((addr >> PAGE_SHIFT) != (last >> PAGE_SHIFT) && in_pmem(last)) code_page_bump(last);
+  IFDEF(CONFIG_DECODE_CACHE, decode_cache_invalidate(addr, len));
+}
+
+static inline bool code_page_touched(paddr_t addr, int len) {
+  paddr_t last = addr + len - 1;
+  return code_page_gen_of(addr) != 0 || (in_pmem(last) && code_page_gen_of(last) != 0);
+}
+
+// code pages may be changed by restoring a snapshot
+static void code_page_reload() {
+  int i;
+  for (i = 0; i < ARRLEN(code_page_gen); i ++) {
+    if (code_page_gen[i] != 0) { code_page_write(CONFIG_MBASE + ((paddr_t)i << PAGE_SHIFT), PAGE_SIZE); }
+  }
+}
+#endif
+
+#ifdef CONFIG_WATCHPOINT
+static uint16_t watch_page_cnt[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+#define watch_page_cnt_of(addr) watch_page_cnt[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+// check the watchpoints if [addr, addr + len) touches a page watched
+static void watch_check(paddr_t addr, int len) {
+  paddr_t last = addr + len - 1;
+  if (unlikely(watch_page_cnt_of(addr) != 0 || (in_pmem(last) && watch_page_cnt_of(last) != 0))) {
+    wp_store(addr, len);
+  }
+}
+#endif
+
 static void pmem_write(paddr_t addr, int len, word_t data) {
   host_write(guest_to_host(addr), len, data);
+#ifdef CONFIG_PMEM_CODE_TRACK
+  if (unlikely(code_page_touched(addr, len))) { code_page_write(addr, len); }
+#endif
+  IFDEF(CONFIG_WATCHPOINT, watch_check(addr, len));
 }
 
 static void out_of_bound(paddr_t addr) {
@@ -41,62 +113,250 @@ static void out_of_bound(paddr_t addr) {
       addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
 }
 
-void init_mem() {
-#if   defined(CONFIG_PMEM_MALLOC)
-  pmem = malloc(CONFIG_MSIZE);
-  assert(pmem);
+/* Every region of the guest physical address space is registered by
+ * paddr_add_region(), and its pages are mapped in `page_table`. A page of host
+ * memory is accessed with one lookup. A device page points to the map covering
+ * it, or is dispatched by mmio_read()/mmio_write() if it holds several maps.
+ * Accesses to devices, crossing a page, or writing a page holding cached code
+ * or watched by sdb take the slow path. The list of regions is only kept to
+ * check overlaps. */
+
+typedef struct MemRegion {
+  const char *name;
+  paddr_t low, high;
+  struct MemRegion *next;
+} MemRegion;
+
+static MemRegion *regions = NULL;
+
+typedef struct {
+  uint8_t *r; // host memory of the page for reads, NULL to take the slow path
+  uint8_t *w; // host memory of the page for writes, NULL to take the slow path
+  IOMap *map; // the device map covering the whole page
+  bool mmio;  // the page holds several device maps
+} PageEntry;
+
+// the page table only covers the lower 4GB of the address space
+#define NR_PAGE (1ull << (32 - PAGE_SHIFT))
+static PageEntry page_table[NR_PAGE] = {};
+
+static inline PageEntry* page_entry(paddr_t addr) {
+#ifdef PMEM64
+  if (addr >= (NR_PAGE << PAGE_SHIFT)) return NULL;
 #endif
-  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
-  Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
+  return &page_table[addr >> PAGE_SHIFT];
+}
+
+// host memory of [addr, addr + len) out of pmem, NULL if it is not contiguous
+static inline uint8_t* host_span(PageEntry *e, paddr_t addr, int len) {
+  if (e == NULL || e->r == NULL) return NULL;
+  paddr_t off = addr & PAGE_MASK;
+  if (off > PAGE_SIZE - len) {
+    PageEntry *next = page_entry(addr + len - 1);
+    if (next == NULL || next->r != e->r + PAGE_SIZE) return NULL;
+  }
+  return e->r + off;
+}
+
+void paddr_add_region(const char *name, paddr_t addr, uint64_t len, uint8_t *host, IOMap *map) {
+  paddr_t left = addr, right = addr + len - 1;
+  MemRegion *r;
+  for (r = regions; r != NULL; r = r->next) {
+    if (left <= r->high && right >= r->low) {
+      panic("region %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped "
+          "with %s@[" FMT_PADDR ", " FMT_PADDR "]", name, left, right, r->name, r->low, r->high);
+    }
+  }
+  r = malloc(sizeof(*r));
+  assert(r);
+  *r = (MemRegion) { .name = name, .low = left, .high = right, .next = regions };
+  regions = r;
+
+  if (host == NULL) {
+    paddr_t page;
+    for (page = left & ~PAGE_MASK; page <= right && page >= (left & ~PAGE_MASK); page += PAGE_SIZE) {
+      PageEntry *e = page_entry(page);
+      Assert(e != NULL, "device %s above 4GB is not supported", name);
+      if (map != NULL && left <= page && right >= page + PAGE_MASK) e->map = map;
+      else e->mmio = true;
+    }
+    return;
+  }
+  Assert((addr & PAGE_MASK) == 0 && (len & PAGE_MASK) == 0,
+      "region %s@[" FMT_PADDR ", " FMT_PADDR "] is not page aligned", name, left, right);
+  uint64_t off;
+  for (off = 0; off < len; off += PAGE_SIZE) {
+    PageEntry *e = page_entry(addr + off);
+    Assert(e != NULL || in_pmem(addr + off), "region %s above 4GB is not supported", name);
+    if (e != NULL) { e->r = e->w = host + off; }
+  }
 }
 
+#ifdef CONFIG_PMEM_CODE_TRACK
+// let stores to code pages take the slow path to pmem_write()
+static void page_table_protect(paddr_t addr) {
+  PageEntry *e = page_entry(addr);
+  if (e != NULL) { e->w = NULL; }
+}
+#endif
+
+#ifdef CONFIG_WATCHPOINT
+void paddr_watch(paddr_t addr, bool on) {
+  Assert(in_pmem(addr), "can not watch address " FMT_PADDR " out of pmem", addr);
+  uint16_t *cnt = &watch_page_cnt_of(addr);
+  if (on) { assert(*cnt < UINT16_MAX); (*cnt) ++; }
+  else { assert(*cnt > 0); (*cnt) --; }
+  PageEntry *e = page_entry(addr);
+  if (e == NULL) return;
+  bool code = MUXDEF(CONFIG_PMEM_CODE_TRACK, code_page_gen_of(addr) != 0, false);
+  e->w = (*cnt != 0 || code ? NULL : e->r);
+  // stores translated by the JIT only leave the fast path for code pages
+  IFDEF(CONFIG_BLOCK_JIT, if (*cnt != 0) pmem_mark_code(addr));
+}
+#endif
+
 // ysyxSoC memory support
 #define MROM_BASE 0x20000000
 #define MROM_SIZE 0x1000
 #define SRAM_BASE 0x0f000000
 #define SRAM_SIZE 0x2000
 
-static uint8_t mrom[MROM_SIZE];
-static uint8_t sram[SRAM_SIZE];
+static uint8_t mrom[MROM_SIZE] PG_ALIGN;
+static uint8_t sram[SRAM_SIZE] PG_ALIGN;
+
+#ifdef CONFIG_PMEM_MEMFD
+#include <sys/mman.h>
+#include <unistd.h>
 
-static bool in_ysyxsoc(paddr_t addr) {
-  if (addr >= MROM_BASE && addr < MROM_BASE + MROM_SIZE) return true;
-  if (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE) return true;
-  return false;
+/* pmem is a shared mapping of the memfd during the initialization, so that
+ * the images loaded stay in the memfd. pmem_seal() then maps the memfd
+ * privately at the same address, and pmem_reset() drops the private pages. */
+static int pmem_fd = -1;
+
+static void pmem_map(int flags) {
+  void *p = mmap(pmem, CONFIG_MSIZE, PROT_READ | PROT_WRITE, flags, pmem_fd, 0);
+  Assert(p != MAP_FAILED, "can not map pmem");
+  pmem = p;
 }
 
-static word_t ysyxsoc_read(paddr_t addr, int len) {
-  if (addr >= MROM_BASE && addr < MROM_BASE + MROM_SIZE) {
-    return host_read(mrom + (addr - MROM_BASE), len);
-  }
-  if (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE) {
-    return host_read(sram + (addr - SRAM_BASE), len);
-  }
-  return 0;
+void pmem_seal() {
+  pmem_map(MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE);
 }
 
-static void ysyxsoc_write(paddr_t addr, int len, word_t data) {
-  if (addr >= MROM_BASE && addr < MROM_BASE + MROM_SIZE) {
-    host_write(mrom + (addr - MROM_BASE), len, data);
-    return;
-  }
-  if (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE) {
-    host_write(sram + (addr - SRAM_BASE), len, data);
-    return;
-  }
+void pmem_reset() {
+  int ret = madvise(pmem, CONFIG_MSIZE, MADV_DONTNEED);
+  assert(ret == 0);
+  IFDEF(CONFIG_PMEM_CODE_TRACK, code_page_reload());
 }
+#endif
 
-word_t paddr_read(paddr_t addr, int len) {
+void init_mem() {
+#if   defined(CONFIG_PMEM_MALLOC)
+  pmem = malloc(CONFIG_MSIZE);
+  assert(pmem);
+#elif defined(CONFIG_PMEM_MEMFD)
+  pmem_fd = memfd_create("nemu-pmem", MFD_CLOEXEC);
+  Assert(pmem_fd >= 0 && ftruncate(pmem_fd, CONFIG_MSIZE) == 0, "can not create the memfd of pmem");
+  pmem_map(MAP_SHARED);
+#endif
+  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+  paddr_add_region("pmem", PMEM_LEFT, CONFIG_MSIZE, pmem, NULL);
+  paddr_add_region("mrom", MROM_BASE, MROM_SIZE, mrom, NULL);
+  paddr_add_region("sram", SRAM_BASE, SRAM_SIZE, sram, NULL);
+  snapshot_add("pmem", pmem, CONFIG_MSIZE);
+  snapshot_add("mrom", mrom, MROM_SIZE);
+  snapshot_add("sram", sram, SRAM_SIZE);
+  IFDEF(CONFIG_PMEM_CODE_TRACK, snapshot_add_hook(NULL, code_page_reload));
+  Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
+}
+
+static word_t paddr_read_slow(paddr_t addr, int len) {
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
-  if (in_ysyxsoc(addr)) return ysyxsoc_read(addr, len);
-  IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
+  PageEntry *e = page_entry(addr);
+  uint8_t *host = host_span(e, addr, len);
+  if (host != NULL) return host_read(host, len);
+#ifdef CONFIG_DEVICE
+  if (e != NULL && e->map != NULL) return map_read(addr, len, e->map);
+  if (e != NULL && e->mmio) return mmio_read(addr, len);
+#endif
   out_of_bound(addr);
   return 0;
 }
 
-void paddr_write(paddr_t addr, int len, word_t data) {
+static void paddr_write_slow(paddr_t addr, int len, word_t data) {
   if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
-  if (in_ysyxsoc(addr)) { ysyxsoc_write(addr, len, data); return; }
-  IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
+  PageEntry *e = page_entry(addr);
+  uint8_t *host = host_span(e, addr, len);
+  if (host != NULL) { host_write(host, len, data); return; }
+#ifdef CONFIG_DEVICE
+  if (e != NULL && e->map != NULL) { map_write(addr, len, data, e->map); return; }
+  if (e != NULL && e->mmio) { mmio_write(addr, len, data); return; }
+#endif
   out_of_bound(addr);
 }
+
+word_t paddr_read(paddr_t addr, int len) {
+  PageEntry *e = page_entry(addr);
+  paddr_t off = addr & PAGE_MASK;
+  if (likely(e != NULL && e->r != NULL && off <= PAGE_SIZE - len)) return host_read(e->r + off, len);
+  return paddr_read_slow(addr, len);
+}
+
+#ifdef CONFIG_DIFFTEST_CHECKPOINT
+static inline void ckpt_track(paddr_t addr) {
+  if (likely(in_pmem(addr)) && unlikely(!difftest_dirty[(addr - CONFIG_MBASE) >> PAGE_SHIFT])) {
+    difftest_save_page(addr);
+  }
+}
+#endif
+
+void paddr_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_track(addr); ckpt_track(addr + len - 1));
+#if defined(CONFIG_DIFFTEST) && defined(CONFIG_BLOCK_JIT) && !defined(CONFIG_DIFFTEST_CHECKPOINT)
+  difftest_block_store(addr, len);
+#endif
+  IFDEF(CONFIG_DIFFTEST_PIPELINE, difftest_pipe_store(addr, len, data));
+  IFDEF(CONFIG_IDLE_SKIP, if (unlikely(g_idle_watch)) idle_store(addr, len, data));
+  PageEntry *e = page_entry(addr);
+  paddr_t off = addr & PAGE_MASK;
+  if (likely(e != NULL && e->w != NULL && off <= PAGE_SIZE - len)) { host_write(e->w + off, len, data); return; }
+  paddr_write_slow(addr, len, data);
+}
+
+/* Bulk copies go a page at a time through the host memory of the regions,
+ * and byte by byte through the devices otherwise. */
+static void paddr_copy(paddr_t addr, uint8_t *buf, size_t n, bool to_guest) {
+  while (n > 0) {
+    size_t len = PAGE_SIZE - (addr & PAGE_MASK);
+    if (len > n) len = n;
+    PageEntry *e = page_entry(addr);
+    uint8_t *host = (e != NULL && e->r != NULL ? e->r + (addr & PAGE_MASK) : NULL);
+    if (host == NULL) {
+      size_t i;
+      for (i = 0; i < len; i ++) {
+        if (to_guest) paddr_write(addr + i, 1, buf[i]);
+        else buf[i] = paddr_read(addr + i, 1);
+      }
+    } else if (to_guest) {
+      IFDEF(CONFIG_DIFFTEST_CHECKPOINT, ckpt_track(addr));
+      memcpy(host, buf, len);
+#ifdef CONFIG_PMEM_CODE_TRACK
+      if (in_pmem(addr) && code_page_gen_of(addr) != 0) { code_page_write(addr, len); }
+#endif
+      IFDEF(CONFIG_WATCHPOINT, if (in_pmem(addr)) watch_check(addr, len));
+    } else {
+      memcpy(buf, host, len);
+    }
+    addr += len;
+    buf += len;
+    n -= len;
+  }
+}
+
+void paddr_write_bulk(paddr_t addr, const void *buf, size_t n) {
+  paddr_copy(addr, (uint8_t *)buf, n, true);
+}
+
+void paddr_read_bulk(paddr_t addr, void *buf, size_t n) {
+  paddr_copy(addr, buf, n, false);
+}
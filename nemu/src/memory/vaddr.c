@@ -15,15 +15,21 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <cpu/profile.h>
+#include <cpu/stat.h>
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
   return paddr_read(addr, len);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
+  prof_count(PROF_LOAD);
+  stat_load(len);
   return paddr_read(addr, len);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
+  prof_count(PROF_STORE);
+  stat_store(len);
   paddr_write(addr, len, data);
 }
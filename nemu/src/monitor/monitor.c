@@ -14,6 +14,11 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/difftest.h>
+#include <cpu/profile.h>
+#include <cpu/trace.h>
+#include <device/event.h>
 #include <memory/paddr.h>
 
 void init_rand();
@@ -43,6 +48,14 @@ static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
 static int difftest_port = 1234;
+static char *restore_file = NULL;
+static char *elf_file = NULL;
+static char *prof_file = NULL;
+static char *func_file = NULL;
+static char *itrace_file = NULL;
+static char *decode_file = NULL;
+static char *batch_list = NULL;
+static char *batch_json = NULL;
 
 static long load_img() {
   if (img_file == NULL) {
@@ -72,16 +85,34 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"elf"      , required_argument, NULL, 'e'},
+    {"profile"  , required_argument, NULL, 'f'},
+    {"func-stat", required_argument, NULL, 's'},
+    {"itrace"   , required_argument, NULL, 't'},
+    {"itrace-decode", required_argument, NULL, 'T'},
+    {"lockstep" , no_argument      , NULL, 'L'},
+    {"batch-list", required_argument, NULL, 'B'},
+    {"batch-json", required_argument, NULL, 'J'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhLl:d:p:r:e:f:s:t:T:B:J:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 'e': elf_file = optarg; break;
+      case 'f': prof_file = optarg; break;
+      case 's': func_file = optarg; break;
+      case 't': itrace_file = optarg; break;
+      case 'T': decode_file = optarg; break;
+      case 'B': batch_list = optarg; break;
+      case 'J': batch_json = optarg; break;
+      case 'L': MUXDEF(CONFIG_MULTI_HART, g_hart_lockstep_opt = true, panic("multiple harts are not enabled")); break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -89,6 +120,15 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-r,--restore=FILE       restore the machine from the snapshot FILE\n");
+        printf("\t-e,--elf=FILE           read the symbols of the image from the ELF FILE\n");
+        printf("\t-f,--profile=FILE       write the folded stacks sampled by the profiler to FILE\n");
+        printf("\t-s,--func-stat=FILE     count instructions and memory accesses by functions into FILE\n");
+        printf("\t-t,--itrace=FILE        write the instruction trace to FILE as binary records\n");
+        printf("\t-T,--itrace-decode=FILE print the binary instruction trace in FILE and exit\n");
+        printf("\t-B,--batch-list=FILE    run the images listed in FILE, one per line, in forked children\n");
+        printf("\t-J,--batch-json=FILE    write the results of --batch-list to FILE as JSON instead of stdout\n");
+        printf("\t-L,--lockstep           run the harts by turns of one instruction on one thread\n");
         printf("\n");
         exit(0);
     }
@@ -96,12 +136,156 @@ static int parse_args(int argc, char *argv[]) {
   return 0;
 }
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int is_exit_status_bad();
+
+typedef struct {
+  bool done; // false if the child did not finish the run
+  int state;
+  uint32_t halt_ret;
+  vaddr_t halt_pc;
+  uint64_t nr_inst;
+  uint64_t time; // us
+} RunResult;
+
+static const char* run_result_str(RunResult *r) {
+  if (!r->done) return "crash";
+  switch (r->state) {
+    case NEMU_END: return (r->halt_ret == 0 ? "good" : "bad");
+    case NEMU_ABORT: return "abort";
+    case NEMU_QUIT: return "quit";
+    default: return "stop";
+  }
+}
+
+static void json_str(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s != '\0'; s ++) {
+    if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+    else fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void write_results(FILE *fp, int n, char *imgs[], RunResult *res) {
+  int i;
+  fprintf(fp, "[\n");
+  for (i = 0; i < n; i ++) {
+    RunResult *r = &res[i];
+    fprintf(fp, "  {\"image\": ");
+    json_str(fp, imgs[i]);
+    fprintf(fp, ", \"result\": \"%s\", \"halt_ret\": %" PRIu32 ", \"halt_pc\": \"" FMT_WORD "\", "
+        "\"instructions\": %" PRIu64 ", \"host_time_us\": %" PRIu64 "}%s\n",
+        run_result_str(r), r->halt_ret, r->halt_pc, r->nr_inst, r->time, (i == n - 1 ? "" : ","));
+  }
+  fprintf(fp, "]\n");
+}
+
+/* Run each image in a child forked from the state after loading, with at
+ * most one child for each host CPU at a time. The children share the pages
+ * of NEMU initialized, and with PMEM_MEMFD only get private copies of the
+ * pages they write. The results are written to `json` if it is not NULL,
+ * and the outputs of the profiler of each child to its own FILE.i.
+ * Return the number of failed runs. */
+int fork_images(int n, char *imgs[], FILE *json) {
+  int nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+  pid_t *pid = malloc(sizeof(pid_t) * n);
+  assert(pid);
+  // written by the children
+  RunResult *res = mmap(NULL, sizeof(RunResult) * n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Assert(res != MAP_FAILED, "can not map the results");
+  int i, next = 0, running = 0, nr_fail = 0;
+  while (next < n || running > 0) {
+    if (next < n && running < (nr_cpu > 0 ? nr_cpu : 1)) {
+      fflush(NULL); // not to flush the buffers twice
+      pid[next] = fork();
+      Assert(pid[next] >= 0, "can not fork");
+      if (pid[next] == 0) {
+        IFDEF(CONFIG_PMEM_MEMFD, snapshot_reset());
+        img_file = imgs[next];
+        IFDEF(CONFIG_PROFILER, prof_set_index(next));
+        load_img();
+        difftest_attach();
+        uint64_t nr_inst = g_nr_guest_inst, start = get_time();
+        cpu_exec(-1);
+        res[next] = (RunResult) { .done = true, .state = nemu_state.state, .halt_ret = nemu_state.halt_ret,
+          .halt_pc = nemu_state.halt_pc, .nr_inst = g_nr_guest_inst - nr_inst, .time = get_time() - start };
+        exit(is_exit_status_bad());
+      }
+      next ++;
+      running ++;
+      continue;
+    }
+    int status;
+    pid_t p = wait(&status);
+    assert(p > 0);
+    running --;
+    for (i = 0; pid[i] != p; i ++);
+    bool good = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    nr_fail += !good;
+    Log("%s: %s", imgs[i], good ? ANSI_FMT("GOOD", ANSI_FG_GREEN) : ANSI_FMT("BAD", ANSI_FG_RED));
+  }
+  free(pid);
+  Log("%d of %d runs failed", nr_fail, n);
+  if (json != NULL) write_results(json, n, imgs, res);
+  munmap(res, sizeof(RunResult) * n);
+  return nr_fail;
+}
+
+/* Run the images listed in `file` by fork_images(). Empty lines and lines
+ * starting with '#' are skipped. */
+static int batch_run(const char *file) {
+  FILE *fp = fopen(file, "r");
+  Assert(fp, "Can not open '%s'", file);
+  char **imgs = NULL, *line = NULL;
+  size_t size = 0;
+  int n = 0, max = 0;
+  while (getline(&line, &size, fp) != -1) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *img = line + strspn(line, " \t");
+    if (*img == '\0' || *img == '#') continue;
+    if (n == max) {
+      max = (max == 0 ? 64 : max * 2);
+      imgs = realloc(imgs, sizeof(char *) * max);
+      assert(imgs);
+    }
+    imgs[n] = strdup(img);
+    assert(imgs[n]);
+    n ++;
+  }
+  free(line);
+  fclose(fp);
+  Log("%d images are listed in %s", n, file);
+
+  FILE *json = (batch_json == NULL ? stdout : fopen(batch_json, "w"));
+  Assert(json, "Can not open '%s'", batch_json);
+  int nr_fail = fork_images(n, imgs, json);
+  if (json != stdout) fclose(json);
+  while (n > 0) free(imgs[-- n]);
+  free(imgs);
+  return nr_fail;
+}
+
 void init_monitor(int argc, char *argv[]) {
   /* Perform some global initialization. */
 
   /* Parse arguments. */
   parse_args(argc, argv);
 
+  /* Print a binary instruction trace written by --itrace. */
+  if (decode_file != NULL) {
+#ifdef CONFIG_ITRACE_BINARY
+    itrace_decode(decode_file);
+    exit(0);
+#else
+    panic("binary instruction traces are not enabled");
+#endif
+  }
+
   /* Set random seed. */
   init_rand();
 
@@ -117,17 +301,54 @@ void init_monitor(int argc, char *argv[]) {
   /* Perform ISA dependent initialization. */
   init_isa();
 
+  /* Start every hart from the state after reset. */
+  IFDEF(CONFIG_MULTI_HART, init_harts());
+
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Restore the machine from a snapshot, REF is synchronized if DiffTest is on. */
+  if (restore_file != NULL) {
+#ifdef CONFIG_SNAPSHOT
+    if (!snapshot_load(restore_file)) panic("can not restore from '%s'", restore_file);
+#else
+    panic("snapshots are not enabled");
+#endif
+  }
+
+  /* Start the profiler if --profile or --func-stat is given. */
+#ifdef CONFIG_PROFILER
+  init_profiler(elf_file, prof_file, func_file);
+#else
+  if (prof_file != NULL || func_file != NULL) panic("the profiler is not enabled");
+#endif
+
+  /* Write the instruction trace to a file if --itrace is given. */
+  if (itrace_file != NULL) {
+#ifdef CONFIG_ITRACE_BINARY
+    init_itrace(itrace_file);
+#else
+    panic("binary instruction traces are not enabled");
+#endif
+  }
+
+  /* Keep the state after loading, to reset to it and fork runs from it. */
+#ifdef CONFIG_PMEM_MEMFD
+  pmem_seal();
+  snapshot_mark();
+#endif
+
   /* Initialize the simple debugger. */
   init_sdb();
 
   IFDEF(CONFIG_ITRACE, init_disasm());
 
+  /* Run the images listed by --batch-list, sharing the initialization above. */
+  if (batch_list != NULL) exit(batch_run(batch_list) != 0);
+
   /* Display welcome message. */
   welcome();
 }
@@ -0,0 +1,159 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+#include <cpu/cpu.h>
+#include "sdb.h"
+
+#ifdef CONFIG_BREAKPOINT
+#define NR_BP 32
+#define BP_SET_SIZE 64 // a power of 2, at least twice NR_BP to keep probes short
+
+typedef struct breakpoint {
+  int NO;
+  struct breakpoint *next;
+
+  vaddr_t pc;
+  char *cond_str; // NULL if unconditional
+  Expr *cond;
+  uint64_t hit;    // times reached with the condition true
+  uint64_t ignore; // hits to go before stopping
+} BP;
+
+static BP bp_pool[NR_BP] = {};
+static BP *head = NULL, *free_ = NULL;
+
+/* The breakpoints are also kept in an open-addressed hash set of their pcs
+ * with linear probing, and `g_bp_bloom` is the union of bp_bloom_bits() of
+ * their pcs. Both are rebuilt when a breakpoint is deleted. */
+static BP *bp_set[BP_SET_SIZE] = {};
+uint64_t g_bp_bloom = 0;
+
+void init_bp_pool() {
+  int i;
+  for (i = 0; i < NR_BP; i ++) {
+    bp_pool[i].NO = i;
+    bp_pool[i].next = (i == NR_BP - 1 ? NULL : &bp_pool[i + 1]);
+  }
+
+  head = NULL;
+  free_ = bp_pool;
+}
+
+static inline uint32_t bp_hash(vaddr_t pc) {
+  return ((uint32_t)(pc >> 2) * 0x9e3779b1u >> 16) & (BP_SET_SIZE - 1);
+}
+
+// the slot of `pc` in the set, or the empty slot to insert it
+static BP** bp_slot(vaddr_t pc) {
+  uint32_t i = bp_hash(pc);
+  while (bp_set[i] != NULL && bp_set[i]->pc != pc) i = (i + 1) & (BP_SET_SIZE - 1);
+  return &bp_set[i];
+}
+
+static void bp_rebuild() {
+  memset(bp_set, 0, sizeof(bp_set));
+  g_bp_bloom = 0;
+  BP *bp;
+  for (bp = head; bp != NULL; bp = bp->next) {
+    *bp_slot(bp->pc) = bp;
+    g_bp_bloom |= bp_bloom_bits(bp->pc);
+  }
+}
+
+static BP* bp_find(int no) {
+  BP *bp;
+  for (bp = head; bp != NULL && bp->NO != no; bp = bp->next);
+  if (bp == NULL) printf("No breakpoint number %d\n", no);
+  return bp;
+}
+
+bool bp_check(vaddr_t pc) {
+  BP *bp = *bp_slot(pc);
+  if (bp == NULL) return false;
+  if (bp->cond != NULL) {
+    bool success;
+    word_t val = expr_eval(bp->cond, &success, NULL);
+    // also stop if the condition can not be evaluated
+    if (success && val == 0) return false;
+  }
+  bp->hit ++;
+  if (bp->ignore > 0) { bp->ignore --; return false; }
+  printf("\nBreakpoint %d at " FMT_WORD "\n", bp->NO, pc);
+  if (nemu_state.state == NEMU_RUNNING) nemu_state.state = NEMU_STOP;
+  return true;
+}
+
+// `args` is "EXPR [if COND]"
+void bp_add(char *args) {
+  char *cond = strstr(args, " if ");
+  if (cond != NULL) { *cond = '\0'; cond += 4; }
+  bool success;
+  vaddr_t pc = expr(args, &success);
+  if (!success) return;
+  if (*bp_slot(pc) != NULL) { printf("Breakpoint %d is already at " FMT_WORD "\n", (*bp_slot(pc))->NO, pc); return; }
+  if (free_ == NULL) { printf("No free breakpoint, the limit is %d\n", NR_BP); return; }
+  Expr *c = NULL;
+  if (cond != NULL && (c = expr_compile(cond)) == NULL) return;
+
+  BP *bp = free_;
+  free_ = bp->next;
+  bp->pc = pc;
+  bp->cond = c;
+  bp->cond_str = (cond != NULL ? strdup(cond) : NULL);
+  bp->hit = bp->ignore = 0;
+  // keep the list sorted by numbers
+  BP **p = &head;
+  while (*p != NULL && (*p)->NO < bp->NO) p = &(*p)->next;
+  bp->next = *p;
+  *p = bp;
+  *bp_slot(pc) = bp;
+  g_bp_bloom |= bp_bloom_bits(pc);
+  // blocks formed before may run over the new breakpoint
+  IFDEF(CONFIG_ENGINE_BLOCK, block_flush());
+  printf("Breakpoint %d at " FMT_WORD "%s%s\n", bp->NO, pc, cond != NULL ? " if " : "", cond != NULL ? cond : "");
+}
+
+void bp_delete(int no) {
+  BP **p = &head;
+  while (*p != NULL && (*p)->NO != no) p = &(*p)->next;
+  if (*p == NULL) { printf("No breakpoint number %d\n", no); return; }
+  BP *bp = *p;
+  *p = bp->next;
+  free(bp->cond_str);
+  expr_free(bp->cond);
+  bp->cond_str = NULL;
+  bp->cond = NULL;
+  bp->next = free_;
+  free_ = bp;
+  bp_rebuild();
+}
+
+void bp_ignore(int no, uint64_t count) {
+  BP *bp = bp_find(no);
+  if (bp == NULL) return;
+  bp->ignore = count;
+  printf("Will ignore next %" PRIu64 " crossings of breakpoint %d\n", count, no);
+}
+
+void bp_display() {
+  if (head == NULL) { printf("No breakpoints\n"); return; }
+  printf("%-4s%-12s%-10s%s\n", "Num", "Address", "Hits", "Condition");
+  BP *bp;
+  for (bp = head; bp != NULL; bp = bp->next) {
+    printf("%-4d" FMT_WORD "  %-10" PRIu64 "%s", bp->NO, bp->pc, bp->hit, bp->cond_str != NULL ? bp->cond_str : "");
+    if (bp->ignore > 0) printf("%s(ignore next %" PRIu64 ")", bp->cond_str != NULL ? " " : "", bp->ignore);
+    printf("\n");
+  }
+}
+#endif
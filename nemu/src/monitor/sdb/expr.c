@@ -14,6 +14,8 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/paddr.h>
+#include "sdb.h"
 
 /* We use the POSIX regex functions to process regular expressions.
  * Type 'man regex' for more information about POSIX regex functions.
@@ -21,10 +23,8 @@
 #include <regex.h>
 
 enum {
-  TK_NOTYPE = 256, TK_EQ,
-
-  /* TODO: Add more token types */
-
+  TK_NOTYPE = 256, TK_EQ, TK_NEQ, TK_AND, TK_OR,
+  TK_NUM, TK_REG,
 };
 
 static struct rule {
@@ -32,13 +32,23 @@ static struct rule {
   int token_type;
 } rules[] = {
 
-  /* TODO: Add more rules.
-   * Pay attention to the precedence level of different rules.
-   */
+  /* Pay attention to the precedence level of different rules. */
 
-  {" +", TK_NOTYPE},    // spaces
-  {"\\+", '+'},         // plus
-  {"==", TK_EQ},        // equal
+  {" +", TK_NOTYPE},              // spaces
+  {"0[xX][0-9a-fA-F]+", TK_NUM},  // hexadecimal number
+  {"[0-9]+", TK_NUM},             // decimal number
+  {"\\$[0-9a-z]+", TK_REG},       // register or $pc
+  {"\\+", '+'},                   // plus
+  {"-", '-'},                     // minus or negation
+  {"\\*", '*'},                   // multiply or dereference
+  {"/", '/'},                     // divide
+  {"\\(", '('},
+  {"\\)", ')'},
+  {"==", TK_EQ},                  // equal
+  {"!=", TK_NEQ},                 // not equal
+  {"&&", TK_AND},                 // and
+  {"\\|\\|", TK_OR},              // or
+  {"!", '!'},                     // not
 };
 
 #define NR_REGEX ARRLEN(rules)
@@ -64,40 +74,35 @@ void init_regex() {
 
 typedef struct token {
   int type;
-  char str[32];
+  const char *str; // in the expression, not terminated
+  int len;
 } Token;
 
-static Token tokens[32] __attribute__((used)) = {};
-static int nr_token __attribute__((used))  = 0;
+// there are at most as many tokens as characters
+static Token *tokens = NULL;
+static int nr_token = 0;
 
-static bool make_token(char *e) {
+static bool make_token(const char *e) {
   int position = 0;
   int i;
   regmatch_t pmatch;
 
   nr_token = 0;
+  tokens = realloc(tokens, sizeof(Token) * (strlen(e) + 1));
+  assert(tokens);
 
   while (e[position] != '\0') {
     /* Try all rules one by one. */
     for (i = 0; i < NR_REGEX; i ++) {
       if (regexec(&re[i], e + position, 1, &pmatch, 0) == 0 && pmatch.rm_so == 0) {
-        char *substr_start = e + position;
+        const char *substr_start = e + position;
         int substr_len = pmatch.rm_eo;
 
-        Log("match rules[%d] = \"%s\" at position %d with len %d: %.*s",
-            i, rules[i].regex, position, substr_len, substr_len, substr_start);
-
         position += substr_len;
 
-        /* TODO: Now a new token is recognized with rules[i]. Add codes
-         * to record the token in the array `tokens'. For certain types
-         * of tokens, some extra actions should be performed.
-         */
-
-        switch (rules[i].token_type) {
-          default: TODO();
+        if (rules[i].token_type != TK_NOTYPE) {
+          tokens[nr_token ++] = (Token) { .type = rules[i].token_type, .str = substr_start, .len = substr_len };
         }
-
         break;
       }
     }
@@ -111,15 +116,233 @@ static bool make_token(char *e) {
   return true;
 }
 
+/* Expressions are compiled once into a stack bytecode, so that watchpoints
+ * and conditions evaluated again and again are not parsed again. Registers
+ * are resolved to where they are kept at compile time. */
+
+enum {
+  OP_END, OP_NUM, OP_REG, OP_DEREF, OP_NEG, OP_NOT, OP_BOOL,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_EQ, OP_NEQ,
+  OP_AND, // jump if the top is 0, pop it otherwise
+  OP_OR,  // set the top to 1 and jump if it is not 0, pop it otherwise
+};
+
+typedef struct {
+  int op;
+  union {
+    word_t imm;
+    const word_t *reg;
+    int target; // index of the instruction to jump to
+  };
+} ExprInst;
+
+#define EXPR_STACK_SIZE 32
+
+struct Expr {
+  bool reg;
+  ExprInst code[];
+};
+
+/* The tokens are compiled by recursive descent, with one function for each
+ * precedence level from || (the lowest) to the unary operators. */
+
+static int pos = 0;
+static bool ok = true;
+static ExprInst *code = NULL;
+static int nr_inst = 0, depth = 0;
+
+// print `msg` if it is not NULL, and fail the compilation
+static bool fail(const char *msg) {
+  if (msg != NULL && ok) printf("%s\n", msg);
+  ok = false;
+  return false;
+}
+
+static bool next_is(int type) {
+  if (pos < nr_token && tokens[pos].type == type) { pos ++; return true; }
+  return false;
+}
+
+// `pop` operands are replaced by `push` results
+static ExprInst* emit(int op, int pop, int push) {
+  depth += push - pop;
+  if (depth > EXPR_STACK_SIZE) fail("expression too complex");
+  code[nr_inst] = (ExprInst) { .op = op };
+  return &code[nr_inst ++];
+}
+
+static void compile_or();
+
+static void compile_primary() {
+  if (pos == nr_token) { fail("expression ends unexpectedly"); return; }
+  Token *t = &tokens[pos ++];
+  char buf[32];
+  switch (t->type) {
+    case TK_NUM:
+      emit(OP_NUM, 0, 1)->imm = strtoull(t->str, NULL, 0);
+      return;
+    case TK_REG: {
+      snprintf(buf, sizeof(buf), "%.*s", t->len - 1, t->str + 1);
+      const word_t *reg = isa_reg_str2ptr(buf);
+      if (reg == NULL) { printf("unknown register %.*s\n", t->len, t->str); fail(NULL); return; }
+      emit(OP_REG, 0, 1)->reg = reg;
+      return;
+    }
+    case '(':
+      compile_or();
+      if (ok && !next_is(')')) fail("missing ')'");
+      return;
+    default:
+      printf("unexpected token '%.*s'\n", t->len, t->str);
+      fail(NULL);
+  }
+}
+
+static void compile_unary() {
+  if (next_is('-')) { compile_unary(); emit(OP_NEG, 1, 1); }
+  else if (next_is('!')) { compile_unary(); emit(OP_NOT, 1, 1); }
+  else if (next_is('*')) { compile_unary(); emit(OP_DEREF, 1, 1); }
+  else compile_primary();
+}
+
+static void compile_mul() {
+  compile_unary();
+  while (ok) {
+    if (next_is('*')) { compile_unary(); emit(OP_MUL, 2, 1); }
+    else if (next_is('/')) { compile_unary(); emit(OP_DIV, 2, 1); }
+    else break;
+  }
+}
+
+static void compile_add() {
+  compile_mul();
+  while (ok) {
+    if (next_is('+')) { compile_mul(); emit(OP_ADD, 2, 1); }
+    else if (next_is('-')) { compile_mul(); emit(OP_SUB, 2, 1); }
+    else break;
+  }
+}
+
+static void compile_eq() {
+  compile_add();
+  while (ok) {
+    if (next_is(TK_EQ)) { compile_add(); emit(OP_EQ, 2, 1); }
+    else if (next_is(TK_NEQ)) { compile_add(); emit(OP_NEQ, 2, 1); }
+    else break;
+  }
+}
+
+static void compile_and() {
+  compile_eq();
+  while (ok && next_is(TK_AND)) {
+    int jump = emit(OP_AND, 1, 0) - code;
+    compile_eq();
+    emit(OP_BOOL, 1, 1);
+    code[jump].target = nr_inst;
+  }
+}
+
+static void compile_or() {
+  compile_and();
+  while (ok && next_is(TK_OR)) {
+    int jump = emit(OP_OR, 1, 0) - code;
+    compile_and();
+    emit(OP_BOOL, 1, 1);
+    code[jump].target = nr_inst;
+  }
+}
+
+Expr* expr_compile(const char *e) {
+  if (!make_token(e)) return NULL;
+  if (nr_token == 0) { printf("empty expression\n"); return NULL; }
+
+  // every token emits at most one instruction, except && and || emitting two
+  Expr *ex = malloc(sizeof(Expr) + sizeof(ExprInst) * (nr_token * 2 + 1));
+  assert(ex);
+  ex->reg = false;
+  int i;
+  for (i = 0; i < nr_token; i ++) ex->reg |= (tokens[i].type == TK_REG);
+
+  pos = 0;
+  ok = true;
+  code = ex->code;
+  nr_inst = depth = 0;
+  compile_or();
+  if (ok && pos != nr_token) {
+    printf("unexpected token '%.*s'\n", tokens[pos].len, tokens[pos].str);
+    fail(NULL);
+  }
+  emit(OP_END, 1, 0);
+  if (!ok) { free(ex); return NULL; }
+  return ex;
+}
+
+void expr_free(Expr *e) {
+  free(e);
+}
+
+static bool mem_read(word_t *val, ExprDeps *deps) {
+  paddr_t addr = *val;
+  if (!in_pmem(addr) || !in_pmem(addr + sizeof(word_t) - 1)) {
+    printf("can not read address " FMT_PADDR " out of pmem\n", addr);
+    return false;
+  }
+  if (deps != NULL) {
+    if (deps->nr_mem < MAX_EXPR_MEM) deps->mem[deps->nr_mem] = addr;
+    deps->nr_mem ++;
+  }
+  *val = paddr_read(addr, sizeof(word_t));
+  return true;
+}
+
+/* The operands skipped by && and || are not run, and the memory they read
+ * is not a dependency, as the value does not change until the other
+ * operand does. */
+word_t expr_eval(const Expr *e, bool *success, ExprDeps *deps) {
+  word_t stack[EXPR_STACK_SIZE];
+  word_t *sp = stack; // the next free slot
+  if (deps != NULL) { deps->reg = e->reg; deps->nr_mem = 0; }
+  const ExprInst *pc;
+  *success = false;
+  for (pc = e->code; ; pc ++) {
+    switch (pc->op) {
+      case OP_END: *success = true; return sp[-1];
+      case OP_NUM: *sp ++ = pc->imm; break;
+      case OP_REG: *sp ++ = *pc->reg; break;
+      case OP_DEREF: if (!mem_read(&sp[-1], deps)) return 0; break;
+      case OP_NEG: sp[-1] = -sp[-1]; break;
+      case OP_NOT: sp[-1] = !sp[-1]; break;
+      case OP_BOOL: sp[-1] = (sp[-1] != 0); break;
+      case OP_ADD: sp --; sp[-1] += sp[0]; break;
+      case OP_SUB: sp --; sp[-1] -= sp[0]; break;
+      case OP_MUL: sp --; sp[-1] *= sp[0]; break;
+      case OP_DIV:
+        sp --;
+        if (sp[0] == 0) { printf("division by zero\n"); return 0; }
+        sp[-1] /= sp[0];
+        break;
+      case OP_EQ: sp --; sp[-1] = (sp[-1] == sp[0]); break;
+      case OP_NEQ: sp --; sp[-1] = (sp[-1] != sp[0]); break;
+      case OP_AND:
+        if (sp[-1] == 0) pc = &e->code[pc->target - 1];
+        else sp --;
+        break;
+      case OP_OR:
+        if (sp[-1] != 0) { sp[-1] = 1; pc = &e->code[pc->target - 1]; }
+        else sp --;
+        break;
+      default: panic("bad expression op %d", pc->op);
+    }
+  }
+}
 
 word_t expr(char *e, bool *success) {
-  if (!make_token(e)) {
+  Expr *ex = expr_compile(e);
+  if (ex == NULL) {
     *success = false;
     return 0;
   }
-
-  /* TODO: Insert codes to evaluate the expression. */
-  TODO();
-
-  return 0;
+  word_t val = expr_eval(ex, success, NULL);
+  expr_free(ex);
+  return val;
 }
@@ -24,6 +24,7 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
+void init_bp_pool();
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
@@ -64,6 +65,24 @@ static int cmd_n(char *args);
 static int cmd_si(char *args);
 static int cmd_info(char *args);
 static int cmd_x(char *args);
+static int cmd_p(char *args);
+#ifdef CONFIG_WATCHPOINT
+static int cmd_w(char *args);
+static int cmd_d(char *args);
+#endif
+#ifdef CONFIG_BREAKPOINT
+static int cmd_b(char *args);
+static int cmd_bd(char *args);
+static int cmd_ignore(char *args);
+#endif
+#ifdef CONFIG_SNAPSHOT
+static int cmd_save(char *args);
+static int cmd_load(char *args);
+#endif
+#ifdef CONFIG_PMEM_MEMFD
+static int cmd_reset(char *args);
+static int cmd_fork(char *args);
+#endif
 static struct {
   const char *name;
   const char *description;
@@ -76,7 +95,25 @@ static struct {
   { "si", "step many steps",cmd_si},
   {"info", "Print the information of registers or watchpoints", cmd_info},
   {"x", "Scan memory. Usage: x N EXPR", cmd_x},
+  {"p", "Print the value of an expression. Usage: p EXPR", cmd_p},
+#ifdef CONFIG_WATCHPOINT
+  {"w", "Stop when the value of an expression changes. Usage: w EXPR", cmd_w},
+  {"d", "Delete a watchpoint. Usage: d N", cmd_d},
+#endif
+#ifdef CONFIG_BREAKPOINT
+  {"b", "Stop before executing the instruction at an address. Usage: b EXPR [if COND]", cmd_b},
+  {"bd", "Delete a breakpoint. Usage: bd N", cmd_bd},
+  {"ignore", "Do not stop at a breakpoint for its next hits. Usage: ignore N COUNT", cmd_ignore},
+#endif
   {"skip","skip",cmd_skip},
+#ifdef CONFIG_SNAPSHOT
+  {"save", "Save a snapshot of the machine. Usage: save FILE", cmd_save},
+  {"load", "Restore the machine from a snapshot. Usage: load FILE", cmd_load},
+#endif
+#ifdef CONFIG_PMEM_MEMFD
+  {"reset", "Reset the machine to the state after loading", cmd_reset},
+  {"fork", "Run images in processes forked from the state after loading. Usage: fork IMAGE...", cmd_fork},
+#endif
 
   /* TODO: Add more commands */
 
@@ -99,13 +136,16 @@ static int cmd_si(char *args){
 }
 
 static int cmd_x(char *args){
-  int n = atoi(strtok(args, " "));
-  char *expr = strtok(NULL, " ");
-  if (expr == NULL) {
+  char *arg = (args == NULL ? NULL : strtok(args, " "));
+  char *e = (arg == NULL ? NULL : strtok(NULL, ""));
+  if (e == NULL) {
     printf("Invalid x command\n");
     return 0;
   }
-  uint32_t addr = strtoul(expr, NULL, 0);
+  int n = atoi(arg);
+  bool success;
+  uint32_t addr = expr(e, &success);
+  if (!success) return 0;
   // Scan memory and display the content
   for (int i = 0; i < n; i++) {
     printf("0x%08x: 0x%08x\n", addr + i * 4, vaddr_read(addr + i * 4, 4));
@@ -113,6 +153,52 @@ static int cmd_x(char *args){
   return 0;
 }
 
+static int cmd_p(char *args) {
+  if (args == NULL) { printf("Usage: p EXPR\n"); return 0; }
+  bool success;
+  word_t val = expr(args, &success);
+  if (success) printf(FMT_WORD " (%" PRIu64 ")\n", val, (uint64_t)val);
+  return 0;
+}
+
+#ifdef CONFIG_WATCHPOINT
+static int cmd_w(char *args) {
+  if (args == NULL) { printf("Usage: w EXPR\n"); return 0; }
+  wp_add(args);
+  return 0;
+}
+
+static int cmd_d(char *args) {
+  char *arg = strtok(args, " ");
+  if (arg == NULL) { printf("Usage: d N\n"); return 0; }
+  wp_delete(atoi(arg));
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_BREAKPOINT
+static int cmd_b(char *args) {
+  if (args == NULL) { printf("Usage: b EXPR [if COND]\n"); return 0; }
+  bp_add(args);
+  return 0;
+}
+
+static int cmd_bd(char *args) {
+  char *arg = strtok(args, " ");
+  if (arg == NULL) { printf("Usage: bd N\n"); return 0; }
+  bp_delete(atoi(arg));
+  return 0;
+}
+
+static int cmd_ignore(char *args) {
+  char *no = strtok(args, " ");
+  char *count = strtok(NULL, " ");
+  if (count == NULL) { printf("Usage: ignore N COUNT\n"); return 0; }
+  bp_ignore(atoi(no), strtoull(count, NULL, 0));
+  return 0;
+}
+#endif
+
 static int cmd_info(char *args) {
   if (args == NULL) {
     printf("Invalid info command\n");
@@ -121,15 +207,57 @@ static int cmd_info(char *args) {
   if (args[0] == 'r') {
     // 显示寄存器信息（已有）
     isa_reg_display();
+#ifdef CONFIG_IQUEUE
+  } else if (args[0] == 'i') {
+    iqueue_dump();
+#endif
+#ifdef CONFIG_WATCHPOINT
   } else if (args[0] == 'w') {
-    // 显示监视点信息
-    //list_watchpoints();
+    wp_display();
+#endif
+#ifdef CONFIG_BREAKPOINT
+  } else if (args[0] == 'b') {
+    bp_display();
+#endif
   } else {
     printf("Unknown info command: '%s'\n", args);
   }
   return 0;
 }
 
+#ifdef CONFIG_SNAPSHOT
+static int cmd_save(char *args) {
+  char *file = strtok(args, " ");
+  if (file == NULL) { printf("Usage: save FILE\n"); return 0; }
+  snapshot_save(file);
+  return 0;
+}
+
+static int cmd_load(char *args) {
+  char *file = strtok(args, " ");
+  if (file == NULL) { printf("Usage: load FILE\n"); return 0; }
+  snapshot_load(file);
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_PMEM_MEMFD
+static int cmd_reset(char *args) {
+  snapshot_reset();
+  return 0;
+}
+
+static int cmd_fork(char *args) {
+  char *imgs[64];
+  int n = 0;
+  char *img;
+  for (img = strtok(args, " "); img != NULL && n < ARRLEN(imgs); img = strtok(NULL, " ")) imgs[n ++] = img;
+  if (n == 0) { printf("Usage: fork IMAGE...\n"); return 0; }
+  fork_images(n, imgs, NULL);
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args) {
   /* extract the first argument */
   char *arg = strtok(NULL, " ");
@@ -201,4 +329,7 @@ void init_sdb() {
 
   /* Initialize the watchpoint pool. */
   init_wp_pool();
+
+  /* Initialize the breakpoint pool. */
+  IFDEF(CONFIG_BREAKPOINT, init_bp_pool());
 }
@@ -18,6 +18,33 @@
 
 #include <common.h>
 
+#define MAX_EXPR_MEM 8
+
+// the locations read when evaluating an expression
+typedef struct {
+  bool reg;              // registers or pc are read
+  int nr_mem;            // number of words read from memory, may exceed MAX_EXPR_MEM
+  paddr_t mem[MAX_EXPR_MEM];
+} ExprDeps;
+
+// an expression compiled to stack bytecode
+typedef struct Expr Expr;
+
+// return NULL and print the reason if `e` is not a valid expression
+Expr* expr_compile(const char *e);
+// also record the locations read in `deps` if it is not NULL
+word_t expr_eval(const Expr *e, bool *success, ExprDeps *deps);
+void expr_free(Expr *e);
+// compile, evaluate and free `e` for a single use
 word_t expr(char *e, bool *success);
 
+void wp_add(char *e);
+void wp_delete(int no);
+void wp_display();
+
+void bp_add(char *args);
+void bp_delete(int no);
+void bp_ignore(int no, uint64_t count);
+void bp_display();
+
 #endif
@@ -13,6 +13,9 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include "sdb.h"
 
 #define NR_WP 32
@@ -21,8 +24,11 @@ typedef struct watchpoint {
   int NO;
   struct watchpoint *next;
 
-  /* TODO: Add more members if necessary */
-
+  char *expr;
+  Expr *code;
+  word_t val;
+  uint64_t hit;
+  ExprDeps deps; // the locations read when `val` was evaluated
 } WP;
 
 static WP wp_pool[NR_WP] = {};
@@ -39,5 +45,115 @@ void init_wp_pool() {
   free_ = wp_pool;
 }
 
-/* TODO: Implement the functionality of watchpoint */
+#ifdef CONFIG_WATCHPOINT
+/* A watchpoint only reading memory is re-evaluated when a word it read is
+ * written. The pages of these words are watched by paddr, so that only the
+ * stores to them are checked. A watchpoint reading registers, or too many
+ * words, is re-evaluated after every instruction instead. */
+
+int g_wp_nr_reg = 0;
+
+static bool wp_on_reg(WP *wp) {
+  return wp->deps.reg || wp->deps.nr_mem > MAX_EXPR_MEM;
+}
+
+static void wp_watch(WP *wp, bool on) {
+  if (wp_on_reg(wp)) { g_wp_nr_reg += (on ? 1 : -1); return; }
+  int i;
+  for (i = 0; i < wp->deps.nr_mem; i ++) {
+    paddr_t addr = wp->deps.mem[i], last = addr + sizeof(word_t) - 1;
+    paddr_watch(addr, on);
+    if ((addr >> PAGE_SHIFT) != (last >> PAGE_SHIFT)) paddr_watch(last, on);
+  }
+}
+
+// evaluate `wp` again, and watch the locations read this time
+static bool wp_eval(WP *wp) {
+  bool success;
+  wp_watch(wp, false);
+  word_t val = expr_eval(wp->code, &success, &wp->deps);
+  wp_watch(wp, true);
+  if (success) wp->val = val;
+  return success;
+}
 
+static void wp_update(WP *wp) {
+  word_t old = wp->val;
+  if (!wp_eval(wp) || wp->val == old) return;
+  wp->hit ++;
+  printf("\nWatchpoint %d: %s\n\nOld value = " FMT_WORD "\nNew value = " FMT_WORD "\n",
+      wp->NO, wp->expr, old, wp->val);
+  if (nemu_state.state == NEMU_RUNNING) nemu_state.state = NEMU_STOP;
+}
+
+void wp_store(paddr_t addr, int len) {
+  WP *wp;
+  for (wp = head; wp != NULL; wp = wp->next) {
+    if (wp_on_reg(wp)) continue;
+    int i;
+    for (i = 0; i < wp->deps.nr_mem; i ++) {
+      paddr_t m = wp->deps.mem[i];
+      if (addr < m + sizeof(word_t) && m < addr + len) { wp_update(wp); break; }
+    }
+  }
+}
+
+bool wp_any() {
+  return head != NULL;
+}
+
+void wp_check_reg() {
+  WP *wp;
+  for (wp = head; wp != NULL; wp = wp->next) {
+    if (wp_on_reg(wp)) wp_update(wp);
+  }
+}
+
+void wp_add(char *e) {
+  if (free_ == NULL) { printf("No free watchpoint, the limit is %d\n", NR_WP); return; }
+  WP *wp = free_;
+  wp->code = expr_compile(e);
+  if (wp->code == NULL) return;
+  wp->deps = (ExprDeps) {};
+  if (!wp_eval(wp)) {
+    wp_watch(wp, false);
+    expr_free(wp->code);
+    return;
+  }
+  free_ = wp->next;
+  wp->expr = strdup(e);
+  assert(wp->expr);
+  wp->hit = 0;
+  // keep the list sorted by numbers
+  WP **p = &head;
+  while (*p != NULL && (*p)->NO < wp->NO) p = &(*p)->next;
+  wp->next = *p;
+  *p = wp;
+  printf("Watchpoint %d: %s = " FMT_WORD "%s\n", wp->NO, wp->expr, wp->val,
+      wp_on_reg(wp) ? " (checked after every instruction)" : "");
+}
+
+void wp_delete(int no) {
+  WP **p = &head;
+  while (*p != NULL && (*p)->NO != no) p = &(*p)->next;
+  if (*p == NULL) { printf("No watchpoint number %d\n", no); return; }
+  WP *wp = *p;
+  *p = wp->next;
+  wp_watch(wp, false);
+  free(wp->expr);
+  expr_free(wp->code);
+  wp->expr = NULL;
+  wp->code = NULL;
+  wp->next = free_;
+  free_ = wp;
+}
+
+void wp_display() {
+  if (head == NULL) { printf("No watchpoints\n"); return; }
+  printf("%-4s%-12s%-10s%s\n", "Num", "Value", "Hits", "What");
+  WP *wp;
+  for (wp = head; wp != NULL; wp = wp->next) {
+    printf("%-4d" FMT_WORD "  %-10" PRIu64 "%s\n", wp->NO, wp->val, wp->hit, wp->expr);
+  }
+}
+#endif
@@ -18,7 +18,13 @@ SRCS-BLACKLIST-y += src/utils/disasm.c
 else
 LIBCAPSTONE = tools/capstone/repo/libcapstone.so.5
 CFLAGS += -I tools/capstone/repo/include
+CFLAGS += -DLIBCAPSTONE=\"$(NEMU_HOME)/$(LIBCAPSTONE)\"
 src/utils/disasm.c: $(LIBCAPSTONE)
 $(LIBCAPSTONE):
 	$(MAKE) -C tools/capstone
 endif
+
+ifndef CONFIG_SNAPSHOT
+SRCS-BLACKLIST-y += src/utils/snapshot.c
+endif
+LIBS += $(if $(CONFIG_SNAPSHOT_ZLIB),-lz,)
@@ -0,0 +1,370 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/event.h>
+#include <device/idle.h>
+#include <cpu/difftest.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CONFIG_SNAPSHOT_ZLIB
+#include <zlib.h>
+#endif
+
+/* A snapshot is a header followed by a section for every registered item,
+ * in the order of registration. An item in whole pages is saved as a bitmap
+ * of its pages not filled by a single byte, i.e. 0 or the pattern of
+ * CONFIG_MEM_RANDOM, followed by these pages, so that the mostly unused
+ * memory costs little. A snapshot is restored from the file mapped by mmap(),
+ * or from a buffer inflated from it if it is compressed by zlib.
+ *
+ * snapshot_mark() keeps a snapshot in memory for snapshot_reset(), leaving out
+ * pmem backed by memfd, which is reset by dropping its private pages. */
+
+#define SNAPSHOT_MAGIC "NEMUSNAP"
+#define SNAPSHOT_VERSION 1
+#define MAX_ITEM 64
+#define MAX_HOOK 16
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nr_item;
+} Header;
+
+typedef struct {
+  char name[24];
+  uint64_t len;  // bytes of the item
+  uint64_t size; // bytes of the section following
+  uint8_t fill;  // the byte filling the pages not saved
+  uint8_t pad[7];
+} Section;
+
+typedef struct {
+  const char *name;
+  void *ptr;
+  size_t len;
+} Item;
+
+static Item items[MAX_ITEM] = {
+  { "cpu", &cpu, sizeof(cpu) },
+  { "guest inst", &g_nr_guest_inst, sizeof(g_nr_guest_inst) },
+};
+static int nr_item = 2;
+
+static struct {
+  void (*save)();
+  void (*load)();
+} hooks[MAX_HOOK];
+static int nr_hook = 0;
+
+void snapshot_add(const char *name, void *ptr, size_t len) {
+  Assert(nr_item < MAX_ITEM, "too many snapshot items");
+  items[nr_item ++] = (Item) { .name = name, .ptr = ptr, .len = len };
+}
+
+void snapshot_add_hook(void (*save)(), void (*load)()) {
+  Assert(nr_hook < MAX_HOOK, "too many snapshot hooks");
+  hooks[nr_hook].save = save;
+  hooks[nr_hook ++].load = load;
+}
+
+static inline bool is_paged(Item *it) { return it->len != 0 && (it->len & PAGE_MASK) == 0; }
+static inline size_t bitmap_size(Item *it) { return ((it->len >> PAGE_SHIFT) + 7) / 8; }
+
+// reset by copy-on-write instead of the marked snapshot
+static inline bool is_cow(Item *it) {
+  return MUXDEF(CONFIG_PMEM_MEMFD, it->ptr == guest_to_host(PMEM_LEFT), false);
+}
+
+static inline bool page_is_filled(const uint8_t *p, uint8_t fill) {
+  return p[0] == fill && memcmp(p, p + 1, PAGE_SIZE - 1) == 0;
+}
+
+// ----------- save -----------
+
+static FILE *out_fp = NULL;
+#ifdef CONFIG_SNAPSHOT_ZLIB
+static gzFile out_gz = NULL;
+#endif
+static bool out_ok = true;
+
+static void out(const void *buf, size_t n) {
+  if (n == 0) return;
+#ifdef CONFIG_SNAPSHOT_ZLIB
+  if (out_gz != NULL) {
+    if (gzwrite(out_gz, buf, n) != (int)n) out_ok = false;
+    return;
+  }
+#endif
+  if (fwrite(buf, n, 1, out_fp) != 1) out_ok = false;
+}
+
+static bool is_gz_file(const char *file) {
+  size_t n = strlen(file);
+  return n > 3 && strcmp(file + n - 3, ".gz") == 0;
+}
+
+static bool out_open(const char *file) {
+  out_ok = true;
+#ifdef CONFIG_SNAPSHOT_ZLIB
+  if (is_gz_file(file)) {
+    out_gz = gzopen(file, "wb6");
+    return out_gz != NULL;
+  }
+#else
+  if (is_gz_file(file)) Log("zlib is not enabled, '%s' is not compressed", file);
+#endif
+  out_fp = fopen(file, "wb");
+  return out_fp != NULL;
+}
+
+static void out_close() {
+#ifdef CONFIG_SNAPSHOT_ZLIB
+  if (out_gz != NULL && gzclose(out_gz) != Z_OK) out_ok = false;
+  out_gz = NULL;
+#endif
+  if (out_fp != NULL && fclose(out_fp) != 0) out_ok = false;
+  out_fp = NULL;
+}
+
+static void save_item(Item *it, bool mark) {
+  Section sec = { .len = it->len, .size = it->len };
+  strncpy(sec.name, it->name, sizeof(sec.name) - 1);
+  if (mark && is_cow(it)) {
+    sec.size = 0;
+    out(&sec, sizeof(sec));
+    return;
+  }
+  if (!is_paged(it)) {
+    out(&sec, sizeof(sec));
+    out(it->ptr, it->len);
+    return;
+  }
+
+  size_t nr_page = it->len >> PAGE_SHIFT, i;
+  uint8_t *bitmap = calloc(bitmap_size(it), 1);
+  assert(bitmap);
+  // the fill byte is taken from the first page filled by a single byte
+  for (i = 0; i < nr_page; i ++) {
+    uint8_t *page = (uint8_t *)it->ptr + (i << PAGE_SHIFT);
+    if (page_is_filled(page, page[0])) { sec.fill = page[0]; break; }
+  }
+  sec.size = bitmap_size(it);
+  for (i = 0; i < nr_page; i ++) {
+    if (!page_is_filled((uint8_t *)it->ptr + (i << PAGE_SHIFT), sec.fill)) {
+      bitmap[i / 8] |= 1 << (i % 8);
+      sec.size += PAGE_SIZE;
+    }
+  }
+  out(&sec, sizeof(sec));
+  out(bitmap, bitmap_size(it));
+  for (i = 0; i < nr_page; i ++) {
+    if (bitmap[i / 8] & (1 << (i % 8))) out((uint8_t *)it->ptr + (i << PAGE_SHIFT), PAGE_SIZE);
+  }
+  free(bitmap);
+}
+
+static void save_snapshot(bool mark) {
+  int i;
+  for (i = 0; i < nr_hook; i ++) {
+    if (hooks[i].save != NULL) hooks[i].save();
+  }
+  Header h = { .version = SNAPSHOT_VERSION, .nr_item = nr_item };
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  out(&h, sizeof(h));
+  for (i = 0; i < nr_item; i ++) save_item(&items[i], mark);
+  out_close();
+}
+
+bool snapshot_save(const char *file) {
+  if (!out_open(file)) {
+    printf("Can not open '%s'\n", file);
+    return false;
+  }
+  save_snapshot(false);
+
+  if (!out_ok) { printf("Can not write '%s'\n", file); return false; }
+  Log("Snapshot saved to %s at %" PRIu64 " instructions", file, g_nr_guest_inst);
+  return true;
+}
+
+// ----------- load -----------
+
+// check every section before changing anything
+static bool check_snapshot(const uint8_t *buf, size_t n) {
+  Header h;
+  if (n < sizeof(h)) return false;
+  memcpy(&h, buf, sizeof(h));
+  if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 || h.version != SNAPSHOT_VERSION) {
+    printf("Not a snapshot of this version\n");
+    return false;
+  }
+  if (h.nr_item != nr_item) {
+    printf("The snapshot has %u items, but %d are expected\n", h.nr_item, nr_item);
+    return false;
+  }
+
+  size_t off = sizeof(h);
+  int i;
+  for (i = 0; i < nr_item; i ++) {
+    Item *it = &items[i];
+    Section sec;
+    if (n - off < sizeof(sec)) return false;
+    memcpy(&sec, buf + off, sizeof(sec));
+    off += sizeof(sec);
+    if (strncmp(sec.name, it->name, sizeof(sec.name) - 1) != 0 || sec.len != it->len) {
+      printf("Item %d of the snapshot is %.23s with %" PRIu64 " bytes, but %s with %zu bytes is expected\n",
+          i, sec.name, sec.len, it->name, it->len);
+      return false;
+    }
+    if (sec.size > n - off) return false;
+    if (is_paged(it)) {
+      size_t nr_page = it->len >> PAGE_SHIFT, nr_set = 0, j;
+      if (sec.size < bitmap_size(it)) return false;
+      for (j = 0; j < nr_page; j ++) nr_set += (buf[off + j / 8] >> (j % 8)) & 1;
+      if (sec.size != bitmap_size(it) + nr_set * PAGE_SIZE) return false;
+    } else if (sec.size != it->len) return false;
+    off += sec.size;
+  }
+  return off == n;
+}
+
+static void load_snapshot(const uint8_t *buf, bool mark) {
+  const uint8_t *p = buf + sizeof(Header);
+  int i;
+  for (i = 0; i < nr_item; i ++) {
+    Item *it = &items[i];
+    uint8_t fill = p[offsetof(Section, fill)];
+    p += sizeof(Section);
+    if (mark && is_cow(it)) continue;
+    if (!is_paged(it)) {
+      memcpy(it->ptr, p, it->len);
+      p += it->len;
+      continue;
+    }
+
+    const uint8_t *bitmap = p;
+    size_t nr_page = it->len >> PAGE_SHIFT, j;
+    p += bitmap_size(it);
+    for (j = 0; j < nr_page; j ++) {
+      uint8_t *page = (uint8_t *)it->ptr + (j << PAGE_SHIFT);
+      if (bitmap[j / 8] & (1 << (j % 8))) {
+        memcpy(page, p, PAGE_SIZE);
+        p += PAGE_SIZE;
+      } else if (!page_is_filled(page, fill)) {
+        // untouched host pages are left unmapped
+        memset(page, fill, PAGE_SIZE);
+      }
+    }
+  }
+}
+
+#ifdef CONFIG_SNAPSHOT_ZLIB
+static uint8_t* inflate_file(const char *file, size_t *n) {
+  gzFile gz = gzopen(file, "rb");
+  if (gz == NULL) return NULL;
+  size_t cap = 1 << 20, len = 0;
+  uint8_t *buf = malloc(cap);
+  assert(buf);
+  int ret;
+  while ((ret = gzread(gz, buf + len, cap - len)) > 0) {
+    len += ret;
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      assert(buf);
+    }
+  }
+  gzclose(gz);
+  if (ret < 0) { free(buf); return NULL; }
+  *n = len;
+  return buf;
+}
+#endif
+
+static void after_load() {
+  int i;
+  for (i = 0; i < nr_hook; i ++) {
+    if (hooks[i].load != NULL) hooks[i].load();
+  }
+  IFDEF(CONFIG_IDLE_SKIP, idle_reset());
+  difftest_attach();
+  nemu_state.state = NEMU_STOP;
+}
+
+bool snapshot_load(const char *file) {
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    if (fd >= 0) close(fd);
+    printf("Can not open '%s'\n", file);
+    return false;
+  }
+  size_t n = st.st_size;
+  uint8_t *map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { printf("Can not map '%s'\n", file); return false; }
+
+  uint8_t *buf = map;
+#ifdef CONFIG_SNAPSHOT_ZLIB
+  if (n >= 2 && map[0] == 0x1f && map[1] == 0x8b) {
+    buf = inflate_file(file, &n);
+    if (buf == NULL) {
+      munmap(map, st.st_size);
+      printf("Can not inflate '%s'\n", file);
+      return false;
+    }
+  }
+#endif
+
+  bool ok = check_snapshot(buf, n);
+  if (ok) load_snapshot(buf, false);
+  else printf("'%s' is not a valid snapshot\n", file);
+  if (buf != map) free(buf);
+  munmap(map, st.st_size);
+  if (!ok) return false;
+
+  after_load();
+  Log("Snapshot restored from %s at %" PRIu64 " instructions, pc = " FMT_WORD, file, g_nr_guest_inst, cpu.pc);
+  return true;
+}
+
+// ----------- mark -----------
+
+static char *mark_buf = NULL;
+static size_t mark_size = 0;
+
+void snapshot_mark() {
+  free(mark_buf);
+  mark_buf = NULL;
+  out_ok = true;
+  out_fp = open_memstream(&mark_buf, &mark_size);
+  assert(out_fp);
+  save_snapshot(true);
+  assert(out_ok);
+}
+
+void snapshot_reset() {
+  Assert(mark_buf != NULL, "no state is marked");
+  IFDEF(CONFIG_PMEM_MEMFD, pmem_reset());
+  load_snapshot((uint8_t *)mark_buf, true);
+  after_load();
+}
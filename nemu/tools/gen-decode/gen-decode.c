@@ -0,0 +1,400 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Turn the INSTPAT patterns of an inst.c into a decision tree.
+ *
+ * Usage: gen-decode [-o OUTPUT] INST_C...
+ *
+ * For every INSTPAT_START()/INSTPAT_END() block, a function
+ *   static inline int decode_tree_<start line>(uint64_t inst)
+ * is emitted. It returns the index (in source order) of the first pattern
+ * matching `inst`, which is exactly what the linear INSTPAT matching selects,
+ * or -1 if no pattern matches. The tree switches on the bits fixed by all
+ * remaining candidates, and falls back to masked comparisons when the
+ * candidates do not share enough bits. A summary of the worst-case number of
+ * comparisons before and after is printed for every block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX_PAT 1024
+#define MAX_SWITCH_BITS 10
+
+typedef struct {
+  char name[64];
+  int line;
+  uint64_t key, mask; // matched if (inst & mask) == key
+} Pattern;
+
+typedef struct {
+  int start_line, end_line;
+  int nr_pat;
+  Pattern pat[MAX_PAT];
+} Block;
+
+static FILE *out = NULL;
+static int tree_worst = 0;
+static int tree_worst_idx = -1;
+static bool selected[MAX_PAT] = {};
+
+static char *read_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) { perror(path); exit(1); }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  assert(buf);
+  size_t ret = fread(buf, 1, size, fp);
+  assert(ret == (size_t)size);
+  buf[size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// blank out comments, but keep the newlines to preserve line numbers
+static void strip_comments(char *p) {
+  bool in_str = false;
+  for (; *p != '\0'; p ++) {
+    if (in_str) {
+      if (*p == '\\' && p[1] != '\0') p ++;
+      else if (*p == '"') in_str = false;
+    } else if (*p == '"') {
+      in_str = true;
+    } else if (p[0] == '/' && p[1] == '/') {
+      for (; *p != '\0' && *p != '\n'; p ++) *p = ' ';
+      if (*p == '\0') break;
+    } else if (p[0] == '/' && p[1] == '*') {
+      for (; *p != '\0' && !(p[0] == '*' && p[1] == '/'); p ++) {
+        if (*p != '\n') *p = ' ';
+      }
+      if (*p == '\0') break;
+      p[0] = p[1] = ' ';
+      p ++;
+    }
+  }
+}
+
+static int line_of(const char *buf, const char *p) {
+  int line = 1;
+  for (; buf < p; buf ++) { if (*buf == '\n') line ++; }
+  return line;
+}
+
+static const char *skip_space(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p ++;
+  return p;
+}
+
+// same semantics as pattern_decode() in include/cpu/decode.h
+static bool parse_pattern(const char *str, int len, Pattern *pat) {
+  uint64_t key = 0, mask = 0;
+  int i, nr_bit = 0;
+  for (i = 0; i < len; i ++) {
+    char c = str[i];
+    if (c == ' ') continue;
+    if (c != '0' && c != '1' && c != '?') return false;
+    key  = (key  << 1) | (c == '1' ? 1 : 0);
+    mask = (mask << 1) | (c == '?' ? 0 : 1);
+    nr_bit ++;
+  }
+  if (nr_bit > 64) return false;
+  pat->key = key;
+  pat->mask = mask;
+  return true;
+}
+
+static bool match_key(const char **pp, const char *key) {
+  int len = strlen(key);
+  if (strncmp(*pp, key, len) != 0) return false;
+  char c = (*pp)[len];
+  if (c != '(' && c != ' ' && c != '\t') return false;
+  *pp += len;
+  return true;
+}
+
+static int parse_blocks(const char *file, char *buf, Block *blocks, int max_block) {
+  int nr_block = 0;
+  Block *b = NULL;
+  const char *p = buf;
+  while ((p = strstr(p, "INSTPAT")) != NULL) {
+    const char *start = p;
+    if (start > buf && (start[-1] == '_' || (start[-1] >= 'a' && start[-1] <= 'z') ||
+          (start[-1] >= 'A' && start[-1] <= 'Z') || (start[-1] >= '0' && start[-1] <= '9'))) {
+      p += 7;
+      continue;
+    }
+    if (match_key(&p, "INSTPAT_START")) {
+      assert(b == NULL && nr_block < max_block);
+      b = &blocks[nr_block ++];
+      b->start_line = line_of(buf, start);
+      b->nr_pat = 0;
+    } else if (match_key(&p, "INSTPAT_END")) {
+      assert(b != NULL);
+      b->end_line = line_of(buf, start);
+      b = NULL;
+    } else if (match_key(&p, "INSTPAT")) {
+      p = skip_space(p);
+      if (*p != '(') continue; // the definition of the macro
+      if (b == NULL) continue;
+      p = skip_space(p + 1);
+      if (*p != '"') {
+        fprintf(stderr, "%s:%d: pattern should be a string literal\n", file, line_of(buf, start));
+        exit(1);
+      }
+      const char *str = p + 1;
+      const char *str_end = strchr(str, '"');
+      assert(str_end);
+      assert(b->nr_pat < MAX_PAT);
+      Pattern *pat = &b->pat[b->nr_pat ++];
+      pat->line = line_of(buf, start);
+      if (!parse_pattern(str, str_end - str, pat)) {
+        fprintf(stderr, "%s:%d: invalid pattern\n", file, pat->line);
+        exit(1);
+      }
+      p = skip_space(str_end + 1);
+      assert(*p == ',');
+      p = skip_space(p + 1);
+      int i;
+      for (i = 0; i < (int)sizeof(pat->name) - 1 && p[i] != ',' && p[i] != ' ' && p[i] != ')'; i ++) {
+        pat->name[i] = p[i];
+      }
+      pat->name[i] = '\0';
+    } else {
+      p += 7;
+    }
+  }
+  assert(b == NULL);
+  return nr_block;
+}
+
+static void indent(int level) { fprintf(out, "%*s", level * 2, ""); }
+
+static int popcount(uint64_t x) { return __builtin_popcountll(x); }
+
+// the expression extracting the bits in `bits` from `inst`, with the
+// highest one as the most significant bit of the result
+static void emit_extract(uint64_t bits) {
+  int pos = popcount(bits), lo, hi;
+  bool first = true;
+  for (hi = 63; hi >= 0; hi --) {
+    if (!((bits >> hi) & 1)) continue;
+    for (lo = hi; lo > 0 && ((bits >> (lo - 1)) & 1); lo --);
+    int width = hi - lo + 1;
+    pos -= width;
+    unsigned long long m = (1ull << width) - 1;
+    if (first && pos == 0) fprintf(out, "(inst >> %d) & 0x%llx", lo, m);
+    else fprintf(out, "%s(((inst >> %d) & 0x%llx) << %d)", first ? "" : " | ", lo, m, pos);
+    first = false;
+    hi = lo;
+  }
+}
+
+// the value of `key` on the bits in `bits`, packed in the same way as emit_extract()
+static uint64_t pack_bits(uint64_t key, uint64_t bits) {
+  uint64_t val = 0;
+  int i;
+  for (i = 63; i >= 0; i --) {
+    if ((bits >> i) & 1) val = (val << 1) | ((key >> i) & 1);
+  }
+  return val;
+}
+
+static void emit_return(Block *b, int idx, int level) {
+  indent(level);
+  if (idx == -1) fprintf(out, "return -1;\n");
+  else {
+    fprintf(out, "return %d; // %s\n", idx, b->pat[idx].name);
+    selected[idx] = true;
+  }
+}
+
+static void update_worst(int cost, int idx) {
+  if (cost > tree_worst) { tree_worst = cost; tree_worst_idx = idx; }
+}
+
+static void gen_node(Block *b, int *cand, int nr_cand, uint64_t tested, int cost, int level) {
+  int i;
+  // candidates after the first one matching unconditionally are unreachable
+  for (i = 0; i < nr_cand; i ++) {
+    if ((b->pat[cand[i]].mask & ~tested) == 0) { nr_cand = i + 1; break; }
+  }
+  int nr_cond = nr_cand;
+  int tail = -1;
+  if (nr_cand > 0 && (b->pat[cand[nr_cand - 1]].mask & ~tested) == 0) {
+    nr_cond --;
+    tail = cand[nr_cand - 1];
+  }
+
+  if (nr_cond == 0) {
+    emit_return(b, tail, level);
+    update_worst(cost, tail);
+    return;
+  }
+
+  uint64_t common = ~0ull;
+  for (i = 0; i < nr_cond; i ++) { common &= b->pat[cand[i]].mask & ~tested; }
+
+  if (nr_cond == 1 || common == 0 || popcount(common) > MAX_SWITCH_BITS) {
+    // compare the remaining candidates one by one
+    for (i = 0; i < nr_cond; i ++) {
+      Pattern *pat = &b->pat[cand[i]];
+      uint64_t m = pat->mask & ~tested;
+      indent(level);
+      fprintf(out, "if ((inst & 0x%llx) == 0x%llx) return %d; // %s\n",
+          (unsigned long long)m, (unsigned long long)(pat->key & m), cand[i], pat->name);
+      selected[cand[i]] = true;
+      update_worst(cost + i + 1, cand[i]);
+    }
+    emit_return(b, tail, level);
+    return;
+  }
+
+  // switch on the bits fixed by all conditional candidates
+  int nr_val = 1 << popcount(common);
+  int (*sub)[MAX_PAT] = malloc(sizeof(*sub) * nr_val);
+  int *nr_sub = malloc(sizeof(int) * nr_val);
+  int *group = malloc(sizeof(int) * nr_val); // the first value with the same sub-candidates
+  assert(sub && nr_sub && group);
+  int v, j;
+  for (v = 0; v < nr_val; v ++) {
+    nr_sub[v] = 0;
+    for (i = 0; i < nr_cand; i ++) {
+      // keep the candidates agreeing with `v` on the bits they fix
+      Pattern *pat = &b->pat[cand[i]];
+      if (((pack_bits(pat->key, common) ^ v) & pack_bits(pat->mask, common)) == 0) {
+        sub[v][nr_sub[v] ++] = cand[i];
+      }
+    }
+    group[v] = v;
+    for (j = 0; j < v; j ++) {
+      if (group[j] == j && nr_sub[j] == nr_sub[v] &&
+          memcmp(sub[j], sub[v], sizeof(int) * nr_sub[v]) == 0) { group[v] = j; break; }
+    }
+  }
+
+  // the largest group becomes the default case
+  int def = 0, def_size = 0;
+  for (v = 0; v < nr_val; v ++) {
+    if (group[v] != v) continue;
+    int size = 0;
+    for (j = v; j < nr_val; j ++) { if (group[j] == v) size ++; }
+    if (size > def_size) { def = v; def_size = size; }
+  }
+
+  indent(level);
+  fprintf(out, "switch (");
+  emit_extract(common);
+  fprintf(out, ") {\n");
+  for (v = 0; v < nr_val; v ++) {
+    if (group[v] != v || v == def) continue;
+    for (j = v; j < nr_val; j ++) {
+      if (group[j] == v) { indent(level + 1); fprintf(out, "case 0x%x:\n", j); }
+    }
+    gen_node(b, sub[v], nr_sub[v], tested | common, cost + 1, level + 2);
+  }
+  indent(level + 1);
+  fprintf(out, "default:\n");
+  gen_node(b, sub[def], nr_sub[def], tested | common, cost + 1, level + 2);
+  indent(level);
+  fprintf(out, "}\n");
+
+  free(sub);
+  free(nr_sub);
+  free(group);
+}
+
+static const char *isa_of(const char *path) {
+  // src/isa/$(GUEST_ISA)/inst.c
+  static char isa[64];
+  const char *end = strrchr(path, '/');
+  if (end == NULL) return path;
+  const char *begin = end;
+  while (begin > path && begin[-1] != '/') begin --;
+  int len = end - begin;
+  if (len >= (int)sizeof(isa)) len = sizeof(isa) - 1;
+  memcpy(isa, begin, len);
+  isa[len] = '\0';
+  return isa;
+}
+
+static void gen_block(const char *file, Block *b) {
+  int i;
+  int cand[MAX_PAT];
+  for (i = 0; i < b->nr_pat; i ++) { cand[i] = i; selected[i] = false; }
+  tree_worst = 0;
+  tree_worst_idx = -1;
+
+  fprintf(out, "\n// INSTPAT_START() at %s:%d\n", file, b->start_line);
+  fprintf(out, "#define DECODE_TREE_NR_%d %d\n", b->end_line, b->nr_pat);
+  fprintf(out, "static inline int decode_tree_%d(uint64_t inst) {\n", b->start_line);
+  gen_node(b, cand, b->nr_pat, 0, 0, 1);
+  fprintf(out, "}\n");
+
+  // linear matching tests the patterns in source order, and the worst case
+  // is the last pattern which is not a catch-all
+  int linear_worst = 0, linear_worst_idx = -1;
+  for (i = 0; i < b->nr_pat; i ++) {
+    if (b->pat[i].mask != 0 && selected[i]) { linear_worst = i + 1; linear_worst_idx = i; }
+  }
+
+  printf("%s:%d: %d patterns, worst case %d comparisons (%s) -> %d (%s)\n",
+      isa_of(file), b->start_line, b->nr_pat,
+      linear_worst, linear_worst_idx == -1 ? "none" : b->pat[linear_worst_idx].name,
+      tree_worst, tree_worst_idx == -1 ? "none" : b->pat[tree_worst_idx].name);
+  for (i = 0; i < b->nr_pat; i ++) {
+    if (!selected[i]) {
+      printf("%s:%d: warning: pattern '%s' is shadowed by earlier patterns\n",
+          file, b->pat[i].line, b->pat[i].name);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *out_file = NULL;
+  int i = 1;
+  if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+    out_file = argv[2];
+    i = 3;
+  }
+  if (i >= argc) {
+    fprintf(stderr, "Usage: %s [-o OUTPUT] INST_C...\n", argv[0]);
+    return 1;
+  }
+
+  out = (out_file ? fopen(out_file, "w") : fopen("/dev/null", "w"));
+  if (out == NULL) { perror(out_file); return 1; }
+  fprintf(out, "// Generated by tools/gen-decode. DO NOT EDIT.\n");
+  fprintf(out, "#ifndef __DECODE_TREE_H__\n#define __DECODE_TREE_H__\n");
+
+  static Block blocks[8];
+  for (; i < argc; i ++) {
+    char *buf = read_file(argv[i]);
+    strip_comments(buf);
+    int nr_block = parse_blocks(argv[i], buf, blocks, 8);
+    int j;
+    for (j = 0; j < nr_block; j ++) { gen_block(argv[i], &blocks[j]); }
+    free(buf);
+  }
+
+  fprintf(out, "\n#endif\n");
+  fclose(out);
+  return 0;
+}
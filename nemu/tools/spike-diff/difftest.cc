@@ -15,6 +15,8 @@
 
 #include "mmu.h"
 #include "sim.h"
+#include <algorithm>
+#include <cstring>
 #include "../../include/common.h"
 #include <difftest-def.h>
 
@@ -70,10 +72,39 @@ void sim_t::diff_set_regs(void* diff_context) {
   state->pc = ctx->pc;
 }
 
+// Spike memory is allocated a page at a time, so the copies go through the
+// host pointer of each page, and through the MMU for devices.
+static size_t diff_chunk(reg_t addr, size_t n) {
+  return std::min(n, (size_t)(PGSIZE - (addr % PGSIZE)));
+}
+
 void sim_t::diff_memcpy(reg_t dest, void* src, size_t n) {
   mmu_t* mmu = p->get_mmu();
-  for (size_t i = 0; i < n; i++) {
-    mmu->store<uint8_t>(dest+i, *((uint8_t*)src+i));
+  uint8_t* buf = (uint8_t*)src;
+  for (size_t len; n > 0; dest += len, buf += len, n -= len) {
+    len = diff_chunk(dest, n);
+    char* host = static_cast<simif_t*>(this)->addr_to_mem(dest);
+    if (host != NULL) {
+      memcpy(host, buf, len);
+    } else {
+      for (size_t i = 0; i < len; i++) mmu->store<uint8_t>(dest + i, buf[i]);
+    }
+  }
+  // the copy may overwrite cached instructions
+  mmu->flush_icache();
+}
+
+static void diff_memcpy_to_dut(reg_t src, void* dest, size_t n) {
+  mmu_t* mmu = p->get_mmu();
+  uint8_t* buf = (uint8_t*)dest;
+  for (size_t len; n > 0; src += len, buf += len, n -= len) {
+    len = diff_chunk(src, n);
+    char* host = static_cast<simif_t*>(s)->addr_to_mem(src);
+    if (host != NULL) {
+      memcpy(buf, host, len);
+    } else {
+      for (size_t i = 0; i < len; i++) buf[i] = mmu->load<uint8_t>(src + i);
+    }
   }
 }
 
@@ -83,7 +114,7 @@ __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction)
   if (direction == DIFFTEST_TO_REF) {
     s->diff_memcpy(addr, buf, n);
   } else {
-    assert(0);
+    diff_memcpy_to_dut(addr, buf, n);
   }
 }
 